@@ -0,0 +1,238 @@
+/*
+Read throughput of plain and compressed files, measured the way cat and copyout
+read them: 16 KB at a time through a file handle, with a cold cache on every pass.
+The files are those found on the sample images and, on larger generated images,
+text logs. Each set of files is written to a fresh filesystem of the same size,
+once block-mapped and once compressed, and read back through the page cache
+and with O_DIRECT, where every block read comes from the device.
+*/
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK      16384
+#define WORK_IMAGE "bench.img"
+
+// a set of files is read again and again until this much data or time has gone by
+#define MIN_BYTES  (64<<20)
+#define MIN_TIME   0.5
+
+// generated logs fill this share of the disk, in files of at most FILE_MAX bytes
+#define FILL       0.4
+#define FILE_MAX   (4<<20)
+
+struct corpus {
+	int nfiles;
+	int *sizes;
+	unsigned char **data;
+	long total;
+};
+
+static FILE *out;
+
+static double now( void )
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static int add_file( struct corpus *c, unsigned char *data, int size )
+{
+	int *sizes = realloc(c->sizes,(c->nfiles+1)*sizeof(int));
+	unsigned char **files = realloc(c->data,(c->nfiles+1)*sizeof(unsigned char *));
+	if(sizes) c->sizes = sizes;
+	if(files) c->data = files;
+	if(!sizes || !files) return 0;
+
+	c->sizes[c->nfiles] = size;
+	c->data[c->nfiles] = data;
+	c->nfiles++;
+	c->total += size;
+	return 1;
+}
+
+static void free_corpus( struct corpus *c )
+{
+	for(int i=0; i<c->nfiles; i++) free(c->data[i]);
+	free(c->data);
+	free(c->sizes);
+	memset(c,0,sizeof(*c));
+}
+
+// take every non-empty file of a sample image, read from a copy of it
+static int load_image( const char *path, int nblocks, struct corpus *c )
+{
+	char command[1024];
+	snprintf(command,sizeof(command),"cp %s %s",path,WORK_IMAGE);
+	if(system(command)!=0) return 0;
+
+	struct disk *d = disk_open(WORK_IMAGE,nblocks);
+	if(!d) return 0;
+	struct fs *fs = fs_init(d);
+	int ok = fs && fs_mount(fs);
+
+	// no image has more inodes than fit in all its blocks
+	for(int inumber=1; ok && inumber<nblocks*(BLOCK_SIZE/FS_INODE_SIZE); inumber++) {
+		int size = fs_getsize(fs,inumber);
+		if(size<=0) continue;
+		unsigned char *data = malloc(size);
+		ok = data && fs_read(fs,inumber,data,size,0)==size && add_file(c,data,size);
+		if(!ok) free(data);
+	}
+
+	fs_destroy(fs);
+	disk_close(d);
+	return ok && c->nfiles>0;
+}
+
+// fill a share of a disk of nblocks with log files
+static int generate( int nblocks, struct corpus *c )
+{
+	static const char *requests[] = { "GET /api/items", "POST /login", "GET /health", "DELETE /api/item", "PUT /api/item" };
+	long want = (long)(nblocks*FILL)*BLOCK_SIZE;
+
+	srand(nblocks);
+	while(c->total<want) {
+		int size = want-c->total<FILE_MAX ? want-c->total : FILE_MAX;
+		unsigned char *data = malloc(size+256);
+		if(!data) return 0;
+		int n = 0;
+		while(n<size) {
+			n += sprintf((char*)data+n,"2026-10-%02d %02d:%02d:%02d host%d svc[%d]: %s id=%d took %dms\n",
+				1+rand()%30,rand()%24,rand()%60,rand()%60,1+rand()%5,100+rand()%900,
+				requests[rand()%5],rand()%100000,1+rand()%500);
+		}
+		if(!add_file(c,data,size)) {
+			free(data);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// write the corpus to a fresh filesystem, then read it back until enough time has gone by;
+// returns MB/s, or -1 on failure, and the disk read calls of one pass in *calls
+static double measure( int nblocks, int layout, int flags, const struct corpus *c, int *calls )
+{
+	unsigned char buffer[CHUNK];
+	long bytes = 0;
+	int passes = 0;
+	double elapsed = 0;
+	int ok;
+
+	struct disk *d = disk_open_flags(WORK_IMAGE,nblocks,flags);
+	if(!d) return -1;
+	struct fs *fs = fs_init(d);
+	int *inumbers = malloc(c->nfiles*sizeof(int));
+
+	ok = fs && inumbers && fs_format_layout(fs,layout) && fs_mount(fs);
+	for(int i=0; ok && i<c->nfiles; i++) {
+		inumbers[i] = fs_create(fs);
+		int fd = fs_open(fs,inumbers[i]);
+		ok = inumbers[i]>0 && fd>=0;
+		for(int done=0; ok && done<c->sizes[i]; done+=CHUNK) {
+			int n = c->sizes[i]-done<CHUNK ? c->sizes[i]-done : CHUNK;
+			ok = fs_fwrite(fs,fd,c->data[i]+done,n)==n;
+		}
+		if(fd>=0) fs_close(fs,fd);
+	}
+	if(ok) fs_unmount(fs);
+
+	int reads = disk_nreads(d);
+	while(ok && (bytes<MIN_BYTES || elapsed<MIN_TIME)) {
+		double start = now();
+		ok = fs_mount(fs);
+		for(int i=0; ok && i<c->nfiles; i++) {
+			int fd = fs_open(fs,inumbers[i]);
+			int done = 0;
+			ok = fd>=0;
+			while(ok) {
+				int n = fs_fread(fs,fd,buffer,CHUNK);
+				if(n<=0) break;
+				// the first pass checks what it reads
+				if(passes==0 && memcmp(buffer,c->data[i]+done,n)) ok = 0;
+				done += n;
+			}
+			ok = ok && done==c->sizes[i];
+			if(fd>=0) fs_close(fs,fd);
+		}
+		fs_unmount(fs);
+		elapsed += now()-start;
+		bytes += c->total;
+		passes++;
+	}
+	*calls = passes ? (disk_nreads(d)-reads)/passes : 0;
+
+	free(inumbers);
+	fs_destroy(fs);
+	disk_close(d);
+	return ok ? bytes/elapsed/1e6 : -1;
+}
+
+static void run( const char *name, int nblocks, const struct corpus *c )
+{
+	static const struct { int flags; const char *name; } backends[] = {
+		{ DISK_PREAD, "pread" },
+		{ DISK_PREAD|DISK_DIRECT, "pread+direct" },
+	};
+
+	for(int b=0; b<2; b++) {
+		int plaincalls, compressedcalls;
+		double plain = measure(nblocks,FS_LAYOUT_BLOCKMAP,backends[b].flags,c,&plaincalls);
+		double compressed = measure(nblocks,FS_LAYOUT_COMPRESSED,backends[b].flags,c,&compressedcalls);
+		fprintf(out,"%-14s %7d %5d %9.2f  %-13s",name,nblocks,c->nfiles,c->total/1e6,backends[b].name);
+		if(plain<0 || compressed<0) {
+			fprintf(out," failed\n");
+		} else {
+			fprintf(out," %9.1f %6d %9.1f %6d %7.2fx\n",plain,plaincalls,compressed,compressedcalls,compressed/plain);
+		}
+		fflush(out);
+	}
+}
+
+int main( int argc, char *argv[] )
+{
+	static const struct { const char *path; int nblocks; } images[] = {
+		{ "image.10", 10 },
+		{ "image.25", 25 },
+		{ "image.100", 100 },
+	};
+	static const int generated[] = { 4096, 32768 };
+
+	// the filesystem reports every read on stdout; the results go to the real one
+	out = fdopen(dup(STDOUT_FILENO),"w");
+	if(!out || !freopen("/dev/null","w",stdout)) {
+		perror("bench");
+		return 1;
+	}
+
+	fprintf(out,"%-14s %7s %5s %9s  %-13s %9s %6s %9s %6s %8s\n",
+		"image","blocks","files","MB","backend","plain","reads","compr.","reads","speedup");
+	fprintf(out,"%-14s %7s %5s %9s  %-13s %9s %6s %9s %6s %8s\n",
+		"","","","","","MB/s","/pass","MB/s","/pass","");
+
+	for(int i=0; i<3; i++) {
+		struct corpus c = {0};
+		if(load_image(images[i].path,images[i].nblocks,&c)) run(images[i].path,images[i].nblocks,&c);
+		else fprintf(out,"%-14s couldn't read its files\n",images[i].path);
+		free_corpus(&c);
+	}
+
+	for(int i=0; i<2; i++) {
+		struct corpus c = {0};
+		if(generate(generated[i],&c)) run("generated",generated[i],&c);
+		else fprintf(out,"%-14s out of memory\n","generated");
+		free_corpus(&c);
+	}
+
+	unlink(WORK_IMAGE);
+	fclose(out);
+	return 0;
+}
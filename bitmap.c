@@ -0,0 +1,281 @@
+/*
+Two-level bitmap.
+Bit i lives in words[i/64]; summary bit w is set whenever words[w] is nonzero.
+*/
+
+#include "bitmap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct bitmap {
+	int nbits;
+	int nwords;
+	int nsummary;
+	int nset;
+	int cursor;
+	uint64_t *words;
+	uint64_t *summary;
+};
+
+#define ALL_ONES (~(uint64_t)0)
+
+// runs looked at by bitmap_find_run before it settles for the longest one seen
+#define RUN_CANDIDATES 64
+
+static int ctz( uint64_t x )
+{
+	return __builtin_ctzll(x);
+}
+
+// return the first word at or after word "from" that has a set bit, or -1
+static int nextword( struct bitmap *b, int from )
+{
+	for(int s=from/64; s<b->nsummary; s++) {
+		uint64_t bits = b->summary[s];
+		if(s==from/64) bits &= ALL_ONES << (from%64);
+		if(bits) return s*64 + ctz(bits);
+	}
+	return -1;
+}
+
+static void update_summary( struct bitmap *b, int w )
+{
+	if(b->words[w]) {
+		b->summary[w/64] |= (uint64_t)1 << (w%64);
+	} else {
+		b->summary[w/64] &= ~((uint64_t)1 << (w%64));
+	}
+}
+
+struct bitmap * bitmap_create( int nbits )
+{
+	struct bitmap *b;
+
+	if(nbits<0) return 0;
+
+	b = malloc(sizeof(*b));
+	if(!b) return 0;
+
+	b->nbits = nbits;
+	b->nwords = (nbits+63)/64;
+	b->nsummary = (b->nwords+63)/64;
+	b->nset = 0;
+	b->cursor = 0;
+	b->words = calloc(b->nwords ? b->nwords : 1,sizeof(uint64_t));
+	b->summary = calloc(b->nsummary ? b->nsummary : 1,sizeof(uint64_t));
+	if(!b->words || !b->summary) {
+		free(b->words);
+		free(b->summary);
+		free(b);
+		return 0;
+	}
+
+	return b;
+}
+
+void bitmap_set( struct bitmap *b, int i )
+{
+	int w = i/64;
+	uint64_t bit = (uint64_t)1 << (i%64);
+	if(b->words[w] & bit) return;
+	b->words[w] |= bit;
+	b->summary[w/64] |= (uint64_t)1 << (w%64);
+	b->nset++;
+}
+
+void bitmap_clear( struct bitmap *b, int i )
+{
+	int w = i/64;
+	uint64_t bit = (uint64_t)1 << (i%64);
+	if(!(b->words[w] & bit)) return;
+	b->words[w] &= ~bit;
+	if(!b->words[w]) update_summary(b,w);
+	b->nset--;
+}
+
+int bitmap_test( struct bitmap *b, int i )
+{
+	return (b->words[i/64] >> (i%64)) & 1;
+}
+
+void bitmap_setall( struct bitmap *b )
+{
+	for(int w=0; w<b->nwords; w++) {
+		b->words[w] = ALL_ONES;
+	}
+
+	// never set the bits past the end of the last word
+	if(b->nbits%64) {
+		b->words[b->nwords-1] = ALL_ONES >> (64 - b->nbits%64);
+	}
+
+	for(int w=0; w<b->nwords; w++) {
+		update_summary(b,w);
+	}
+
+	b->nset = b->nbits;
+}
+
+void bitmap_clearall( struct bitmap *b )
+{
+	memset(b->words,0,b->nwords*sizeof(uint64_t));
+	memset(b->summary,0,b->nsummary*sizeof(uint64_t));
+	b->nset = 0;
+}
+
+int bitmap_find( struct bitmap *b )
+{
+	if(b->nwords==0) return -1;
+	if(b->cursor>=b->nbits) b->cursor = 0;
+
+	// rest of the word holding the cursor
+	int w = b->cursor/64;
+	uint64_t bits = b->words[w] & (ALL_ONES << (b->cursor%64));
+
+	if(!bits) {
+		// following words, then wrap around to the start
+		w = nextword(b,w+1);
+		if(w<0) w = nextword(b,0);
+		if(w<0) return -1;
+		bits = b->words[w];
+	}
+
+	int i = w*64 + ctz(bits);
+	b->cursor = i+1;
+	return i;
+}
+
+int bitmap_find_next( struct bitmap *b, int from )
+{
+	if(from<0) from = 0;
+	if(from>=b->nbits) return -1;
+
+	int w = from/64;
+	uint64_t bits = b->words[w] & (ALL_ONES << (from%64));
+
+	if(!bits) {
+		w = nextword(b,w+1);
+		if(w<0) return -1;
+		bits = b->words[w];
+	}
+
+	return w*64 + ctz(bits);
+}
+
+// length of the run of set bits starting at bit i, counting no further than "max"
+static int runlength( struct bitmap *b, int i, int max )
+{
+	int len = 0;
+
+	while(len<max && i+len<b->nbits) {
+		int off = (i+len)%64;
+		uint64_t rest = ~(b->words[(i+len)/64] >> off);
+		int n = rest ? ctz(rest) : 64;
+		if(n>64-off) n = 64-off;
+		len += n;
+		if(n<64-off) break;
+	}
+
+	return len<max ? len : max;
+}
+
+int bitmap_find_run( struct bitmap *b, int goal, int want, int *length )
+{
+	int best = -1, bestlen = 0;
+	int wrapped = 0;
+
+	if(goal<0 || goal>=b->nbits) goal = b->cursor<b->nbits ? b->cursor : 0;
+	if(want<1) want = 1;
+
+	int i = bitmap_find_next(b,goal);
+	for(int tries=0; tries<RUN_CANDIDATES; tries++) {
+		if(i<0 || (wrapped && i>=goal)) {
+			if(wrapped || goal==0) break;
+			wrapped = 1;
+			i = bitmap_find_next(b,0);
+			if(i<0 || i>=goal) break;
+		}
+
+		int len = runlength(b,i,want);
+		if(len>bestlen) {
+			best = i;
+			bestlen = len;
+		}
+		if(len>=want) break;
+
+		i = bitmap_find_next(b,i+len);
+	}
+
+	if(best>=0) {
+		*length = bestlen;
+		b->cursor = best+bestlen;
+	}
+	return best;
+}
+
+int bitmap_count( struct bitmap *b )
+{
+	return b->nset;
+}
+
+int bitmap_nbits( struct bitmap *b )
+{
+	return b->nbits;
+}
+
+void bitmap_or( struct bitmap *b, struct bitmap *other )
+{
+	b->nset = 0;
+	for(int w=0; w<b->nwords; w++) {
+		b->words[w] |= other->words[w];
+		update_summary(b,w);
+		b->nset += __builtin_popcountll(b->words[w]);
+	}
+}
+
+void bitmap_invert( struct bitmap *b )
+{
+	for(int w=0; w<b->nwords; w++) {
+		b->words[w] = ~b->words[w];
+	}
+
+	if(b->nbits%64) {
+		b->words[b->nwords-1] &= ALL_ONES >> (64 - b->nbits%64);
+	}
+
+	for(int w=0; w<b->nwords; w++) {
+		update_summary(b,w);
+	}
+
+	b->nset = b->nbits - b->nset;
+}
+
+void bitmap_load( struct bitmap *b, const uint64_t *words )
+{
+	memcpy(b->words,words,b->nwords*sizeof(uint64_t));
+
+	if(b->nbits%64) {
+		b->words[b->nwords-1] &= ALL_ONES >> (64 - b->nbits%64);
+	}
+
+	b->nset = 0;
+	for(int w=0; w<b->nwords; w++) {
+		update_summary(b,w);
+		b->nset += __builtin_popcountll(b->words[w]);
+	}
+}
+
+void bitmap_store( struct bitmap *b, uint64_t *words )
+{
+	memcpy(words,b->words,b->nwords*sizeof(uint64_t));
+}
+
+void bitmap_destroy( struct bitmap *b )
+{
+	if(!b) return;
+	free(b->words);
+	free(b->summary);
+	free(b);
+}
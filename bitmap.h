@@ -0,0 +1,99 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+/*
+A bitmap stored as 64-bit words, with a summary level holding one bit per word.
+A summary bit is clear exactly when every bit of its word is clear,
+so searches skip 64 empty words at a time and find bits with count-trailing-zeros.
+*/
+
+/*
+Create a bitmap of "nbits" bits, all clear.
+Returns a pointer to a new bitmap object, or null on failure.
+*/
+
+struct bitmap * bitmap_create( int nbits );
+
+/*
+Set, clear or test bit "i".
+*/
+
+void bitmap_set( struct bitmap *b, int i );
+void bitmap_clear( struct bitmap *b, int i );
+int  bitmap_test( struct bitmap *b, int i );
+
+/*
+Set or clear every bit.
+*/
+
+void bitmap_setall( struct bitmap *b );
+void bitmap_clearall( struct bitmap *b );
+
+/*
+Return the index of a set bit, or -1 if none is set.
+The search is next-fit: it starts just after the bit found by the previous call
+and wraps around, so repeated calls walk through the bitmap instead of rescanning it.
+*/
+
+int bitmap_find( struct bitmap *b );
+
+/*
+Return the index of the first set bit at or after bit "from", or -1 if there is none.
+This neither uses nor moves the next-fit position of bitmap_find.
+*/
+
+int bitmap_find_next( struct bitmap *b, int from );
+
+/*
+Find a run of up to "want" consecutive set bits as near after bit "goal" as possible,
+wrapping around at the end; a negative goal starts at the next-fit position.
+The first run of at least "want" bits is taken; if a bounded search finds none,
+the longest run it saw is returned instead.
+Returns the first bit of the run and stores its length, at most "want", in *length,
+or returns -1 if no bit is set. The next-fit position moves to the end of the run.
+*/
+
+int bitmap_find_run( struct bitmap *b, int goal, int want, int *length );
+
+/*
+Return the number of set bits.
+The count is kept up to date by every set and clear, so this takes constant time.
+*/
+
+int bitmap_count( struct bitmap *b );
+
+/*
+Return the number of bits in the bitmap.
+*/
+
+int bitmap_nbits( struct bitmap *b );
+
+/*
+Set every bit of "b" that is set in "other", which must have the same number of bits.
+*/
+
+void bitmap_or( struct bitmap *b, struct bitmap *other );
+
+/*
+Flip every bit.
+*/
+
+void bitmap_invert( struct bitmap *b );
+
+/*
+Copy the bitmap to or from an array of (nbits+63)/64 words, bit i being bit i%64 of word i/64.
+Loading ignores any bits past the end and brings the summary and count up to date.
+*/
+
+void bitmap_load( struct bitmap *b, const uint64_t *words );
+void bitmap_store( struct bitmap *b, uint64_t *words );
+
+/*
+Release the bitmap.
+*/
+
+void bitmap_destroy( struct bitmap *b );
+
+#endif
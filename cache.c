@@ -0,0 +1,463 @@
+/*
+Write-back block cache for the virtual disk.
+Entries are found through a chained hash table keyed by block number.
+Eviction is either LRU, using a doubly linked list ordered by last use,
+or CLOCK, using a reference bit per entry and a sweeping hand.
+One mutex covers the table, and no transfer to or from the disk is made while it is held:
+an entry being filled or written back is marked busy instead, and a thread that needs it
+waits on a condition variable until the transfer is done.
+*/
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// an entry being read from the disk holds nothing yet; one being written to it can be read
+#define IDLE    0
+#define FILLING 1
+#define WRITING 2
+
+struct cache_entry {
+	int block;
+	int dirty;
+	int ref;
+	int busy;
+	int prev;
+	int next;
+	int hnext;
+	unsigned char *data;
+};
+
+struct cache {
+	struct disk *disk;
+	int capacity;
+	int policy;
+	int nused;
+	int hand;
+	int head;
+	int tail;
+	int nbuckets;
+	int *buckets;
+	struct cache_entry *entries;
+	unsigned char *pool;
+	struct cache_stats stats;
+	int nwriting;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+};
+
+static int hash( struct cache *c, int block )
+{
+	return (unsigned)block % c->nbuckets;
+}
+
+static int lookup( struct cache *c, int block )
+{
+	for(int i=c->buckets[hash(c,block)]; i>=0; i=c->entries[i].hnext) {
+		if(c->entries[i].block==block) return i;
+	}
+	return -1;
+}
+
+static void unhash( struct cache *c, int i )
+{
+	int *p = &c->buckets[hash(c,c->entries[i].block)];
+	while(*p!=i) p = &c->entries[*p].hnext;
+	*p = c->entries[i].hnext;
+}
+
+// remove entry i from the LRU list
+static void unlink_entry( struct cache *c, int i )
+{
+	struct cache_entry *e = &c->entries[i];
+	if(e->prev>=0) c->entries[e->prev].next = e->next; else c->head = e->next;
+	if(e->next>=0) c->entries[e->next].prev = e->prev; else c->tail = e->prev;
+	e->prev = e->next = -1;
+}
+
+// put entry i at the most recently used end of the LRU list
+static void push_front( struct cache *c, int i )
+{
+	struct cache_entry *e = &c->entries[i];
+	e->prev = -1;
+	e->next = c->head;
+	if(c->head>=0) c->entries[c->head].prev = i;
+	c->head = i;
+	if(c->tail<0) c->tail = i;
+}
+
+static void touch( struct cache *c, int i )
+{
+	if(c->policy==CACHE_CLOCK) {
+		c->entries[i].ref = 1;
+	} else if(c->head!=i) {
+		unlink_entry(c,i);
+		push_front(c,i);
+	}
+}
+
+// wait until some transfer of the cache ends; the caller holds the lock and looks again
+static void wait_idle( struct cache *c )
+{
+	pthread_cond_wait(&c->idle,&c->lock);
+}
+
+static void set_idle( struct cache *c, int i )
+{
+	if(c->entries[i].busy==WRITING) c->nwriting--;
+	c->entries[i].busy = IDLE;
+	pthread_cond_broadcast(&c->idle);
+}
+
+// choose an entry to hold a new block, passing over busy ones; returns -1 if all are busy
+static int victim( struct cache *c )
+{
+	if(c->nused<c->capacity) return c->nused++;
+
+	if(c->policy==CACHE_CLOCK) {
+		for(int k=0; k<2*c->capacity; k++) {
+			int i = c->hand;
+			c->hand = (c->hand+1) % c->capacity;
+			if(c->entries[i].busy) continue;
+			if(!c->entries[i].ref) return i;
+			c->entries[i].ref = 0;
+		}
+		return -1;
+	}
+
+	int i = c->tail;
+	while(i>=0 && c->entries[i].busy) i = c->entries[i].prev;
+	return i;
+}
+
+// forget the block held by entry i, which is clean
+static void evict( struct cache *c, int i )
+{
+	if(c->entries[i].block<0) return;
+	unhash(c,i);
+	if(c->policy==CACHE_LRU) unlink_entry(c,i);
+	c->entries[i].block = -1;
+}
+
+// write back dirty entry i without the lock; its contents may still be read meanwhile
+static void writeback( struct cache *c, int i )
+{
+	struct cache_entry *e = &c->entries[i];
+	e->busy = WRITING;
+	c->nwriting++;
+	pthread_mutex_unlock(&c->lock);
+	disk_write(c->disk,e->block,e->data);
+	pthread_mutex_lock(&c->lock);
+	e->dirty = 0;
+	c->stats.writebacks++;
+	c->stats.dirty--;
+	set_idle(c,i);
+}
+
+static void insert( struct cache *c, int i, int block )
+{
+	struct cache_entry *e = &c->entries[i];
+	int h = hash(c,block);
+
+	evict(c,i);
+	e->block = block;
+	e->dirty = 0;
+	e->ref = 1;
+	e->hnext = c->buckets[h];
+	c->buckets[h] = i;
+	if(c->policy==CACHE_LRU) push_front(c,i);
+}
+
+// find the entry of a block, or give it one, and return it idle with the lock held.
+// A new entry is filled from the disk if "fill" is set; the lock is dropped while
+// a victim is written back or the entry filled, so the block is looked up again after.
+// Reads count a hit or a miss.
+static int acquire( struct cache *c, int block, int fill )
+{
+	for(;;) {
+		int i = lookup(c,block);
+		if(i>=0) {
+			if(c->entries[i].busy==FILLING || (!fill && c->entries[i].busy)) {
+				wait_idle(c);
+				continue;
+			}
+			if(fill) c->stats.hits++;
+			touch(c,i);
+			return i;
+		}
+
+		i = victim(c);
+		if(i<0) {
+			wait_idle(c);
+		} else if(c->entries[i].dirty) {
+			writeback(c,i);
+		} else {
+			insert(c,i,block);
+			if(!fill) return i;
+			c->stats.misses++;
+			c->entries[i].busy = FILLING;
+			pthread_mutex_unlock(&c->lock);
+			disk_read(c->disk,block,c->entries[i].data);
+			pthread_mutex_lock(&c->lock);
+			set_idle(c,i);
+			return i;
+		}
+	}
+}
+
+struct cache * cache_create( struct disk *d, int capacity, int policy )
+{
+	struct cache *c;
+
+	if(capacity<0) return 0;
+
+	c = calloc(1,sizeof(*c));
+	if(!c) return 0;
+
+	c->disk = d;
+	c->capacity = capacity;
+	c->policy = policy;
+	c->head = c->tail = -1;
+	c->nbuckets = capacity>0 ? capacity*2 : 1;
+
+	c->buckets = malloc(c->nbuckets*sizeof(int));
+	c->entries = calloc(capacity>0 ? capacity : 1,sizeof(struct cache_entry));
+	c->pool = capacity>0 ? aligned_alloc(BLOCK_SIZE,(size_t)capacity*BLOCK_SIZE) : 0;
+	if(!c->buckets || !c->entries || (capacity>0 && !c->pool)) {
+		free(c->buckets);
+		free(c->entries);
+		free(c->pool);
+		free(c);
+		return 0;
+	}
+
+	pthread_mutex_init(&c->lock,0);
+	pthread_cond_init(&c->idle,0);
+	for(int i=0; i<c->nbuckets; i++) c->buckets[i] = -1;
+	for(int i=0; i<capacity; i++) {
+		c->entries[i].block = -1;
+		c->entries[i].prev = c->entries[i].next = c->entries[i].hnext = -1;
+		c->entries[i].data = c->pool + (size_t)i*BLOCK_SIZE;
+	}
+
+	return c;
+}
+
+void cache_read( struct cache *c, int block, unsigned char *data )
+{
+	pthread_mutex_lock(&c->lock);
+
+	if(c->capacity==0) {
+		c->stats.misses++;
+		pthread_mutex_unlock(&c->lock);
+		disk_read(c->disk,block,data);
+		return;
+	}
+
+	int i = acquire(c,block,1);
+	memcpy(data,c->entries[i].data,BLOCK_SIZE);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_write( struct cache *c, int block, const unsigned char *data )
+{
+	pthread_mutex_lock(&c->lock);
+
+	if(c->capacity==0) {
+		c->stats.writebacks++;
+		pthread_mutex_unlock(&c->lock);
+		disk_write(c->disk,block,data);
+		return;
+	}
+
+	int i = acquire(c,block,0);
+	memcpy(c->entries[i].data,data,BLOCK_SIZE);
+	if(!c->entries[i].dirty) c->stats.dirty++;
+	c->entries[i].dirty = 1;
+	pthread_mutex_unlock(&c->lock);
+}
+
+int cache_readv( struct cache *c, const int *blocks, unsigned char **data, int n )
+{
+	int *missblocks = malloc(n*sizeof(int));
+	unsigned char **missdata = malloc(n*sizeof(unsigned char *));
+	int nmiss = 0;
+
+	if(!missblocks || !missdata) {
+		fprintf(stderr,"cache_readv: out of memory\n");
+		abort();
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for(int k=0; k<n; k++) {
+		int i = c->capacity>0 ? lookup(c,blocks[k]) : -1;
+		if(i>=0 && c->entries[i].busy==FILLING) {
+			wait_idle(c);
+			k--;
+		} else if(i>=0) {
+			c->stats.hits++;
+			touch(c,i);
+			memcpy(data[k],c->entries[i].data,BLOCK_SIZE);
+		} else {
+			c->stats.misses++;
+			missblocks[nmiss] = blocks[k];
+			missdata[nmiss] = data[k];
+			nmiss++;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	// a block that is not cached is current on the disk
+	disk_readv(c->disk,missblocks,missdata,nmiss);
+
+	free(missblocks);
+	free(missdata);
+
+	return nmiss;
+}
+
+int cache_prefetch( struct cache *c, const int *blocks, int n )
+{
+	if(c->capacity<2 || n<=0) return 0;
+
+	int *missblocks = malloc(n*sizeof(int));
+	unsigned char **missdata = malloc(n*sizeof(unsigned char *));
+	int nmiss = 0;
+
+	if(!missblocks || !missdata) {
+		fprintf(stderr,"cache_prefetch: out of memory\n");
+		abort();
+	}
+
+	// entries are claimed and marked busy before the batch is read without the lock,
+	// leaving at least one for other threads; a prefetch is only a hint,
+	// so it stops at a victim that would have to be written back first
+	int *entries = malloc(n*sizeof(int));
+	if(!entries) {
+		fprintf(stderr,"cache_prefetch: out of memory\n");
+		abort();
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for(int k=0; k<n && nmiss<c->capacity-1; k++) {
+		if(blocks[k]<=0 || lookup(c,blocks[k])>=0) continue;
+		int i = victim(c);
+		if(i<0 || c->entries[i].dirty) break;
+		insert(c,i,blocks[k]);
+		c->entries[i].busy = FILLING;
+		entries[nmiss] = i;
+		missblocks[nmiss] = blocks[k];
+		missdata[nmiss] = c->entries[i].data;
+		nmiss++;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	disk_readv(c->disk,missblocks,missdata,nmiss);
+
+	pthread_mutex_lock(&c->lock);
+	for(int k=0; k<nmiss; k++) set_idle(c,entries[k]);
+	pthread_mutex_unlock(&c->lock);
+
+	free(entries);
+
+	free(missblocks);
+	free(missdata);
+
+	return nmiss;
+}
+
+void cache_writev( struct cache *c, const int *blocks, const unsigned char **data, int n )
+{
+	// cached copies are refreshed and become clean, since the batch writes them anyway
+	pthread_mutex_lock(&c->lock);
+	for(int k=0; k<n && c->capacity>0; k++) {
+		int i = lookup(c,blocks[k]);
+		if(i>=0 && c->entries[i].busy) {
+			wait_idle(c);
+			k--;
+		} else if(i>=0) {
+			memcpy(c->entries[i].data,data[k],BLOCK_SIZE);
+			if(c->entries[i].dirty) c->stats.dirty--;
+			c->entries[i].dirty = 0;
+		}
+	}
+	c->stats.writebacks += n;
+	pthread_mutex_unlock(&c->lock);
+
+	disk_writev(c->disk,blocks,data,n);
+}
+
+void cache_flush( struct cache *c )
+{
+	pthread_mutex_lock(&c->lock);
+	int n = c->stats.dirty;
+	if(n==0) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+
+	int *blocks = malloc(n*sizeof(int));
+	const unsigned char **data = malloc(n*sizeof(unsigned char *));
+	if(!blocks || !data) {
+		fprintf(stderr,"cache_flush: out of memory\n");
+		abort();
+	}
+
+	// every dirty block goes out in one batch, which the disk sorts by block number
+	// and writes as runs of adjacent blocks; the entries are busy until it is done,
+	// and so are those another thread is writing back, which the flush waits for
+	int *entries = malloc(n*sizeof(int));
+	if(!entries) {
+		fprintf(stderr,"cache_flush: out of memory\n");
+		abort();
+	}
+
+	int k = 0;
+	for(int i=0; i<c->nused; i++) {
+		struct cache_entry *e = &c->entries[i];
+		if(e->block<0 || !e->dirty || e->busy) continue;
+		e->busy = WRITING;
+		c->nwriting++;
+		entries[k] = i;
+		blocks[k] = e->block;
+		data[k++] = e->data;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	disk_writev(c->disk,blocks,data,k);
+
+	pthread_mutex_lock(&c->lock);
+	for(int j=0; j<k; j++) {
+		c->entries[entries[j]].dirty = 0;
+		set_idle(c,entries[j]);
+	}
+	c->stats.writebacks += k;
+	c->stats.dirty -= k;
+	while(c->nwriting>0) wait_idle(c);
+	pthread_mutex_unlock(&c->lock);
+
+	free(entries);
+	free(blocks);
+	free(data);
+}
+
+void cache_getstats( struct cache *c, struct cache_stats *s )
+{
+	pthread_mutex_lock(&c->lock);
+	*s = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_destroy( struct cache *c )
+{
+	cache_flush(c);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->idle);
+	free(c->buckets);
+	free(c->entries);
+	free(c->pool);
+	free(c);
+}
@@ -0,0 +1,87 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "disk.h"
+
+/*
+A write-back block cache that sits between the filesystem and the virtual disk.
+Blocks are kept in memory until they are evicted or the cache is flushed,
+so repeated reads and writes of the same block cost no disk I/O.
+A cache may be used from many threads at once, as long as no two of them
+transfer the same block at the same time. The cache is never locked while it waits
+for the disk, so a miss or a write-back in one thread does not hold up hits in others.
+*/
+
+#define CACHE_LRU   0
+#define CACHE_CLOCK 1
+
+struct cache_stats {
+	long hits;
+	long misses;
+	long writebacks;
+	long dirty;
+};
+
+/*
+Create a cache holding up to "capacity" blocks of disk "d".
+"policy" selects the eviction policy, CACHE_LRU or CACHE_CLOCK.
+A capacity of zero gives a pass-through cache that sends everything to the disk.
+Returns a pointer to a new cache object, or null on failure.
+*/
+
+struct cache * cache_create( struct disk *d, int capacity, int policy );
+
+/*
+Read exactly BLOCK_SIZE bytes of a given block, from memory if it is cached.
+*/
+
+void cache_read( struct cache *c, int block, unsigned char *data );
+
+/*
+Write exactly BLOCK_SIZE bytes to a given block.
+The block is marked dirty and reaches the disk when evicted or flushed.
+*/
+
+void cache_write( struct cache *c, int block, const unsigned char *data );
+
+/*
+Read or write a batch of "n" distinct blocks, as with disk_readv and disk_writev.
+Blocks the cache holds are served from memory, or updated in memory as they are written.
+Everything else goes straight to the disk in one vectored transfer,
+so bulk data does not push metadata out of the cache.
+cache_readv returns the number of blocks that had to come from the disk.
+*/
+
+int  cache_readv( struct cache *c, const int *blocks, unsigned char **data, int n );
+void cache_writev( struct cache *c, const int *blocks, const unsigned char **data, int n );
+
+/*
+Load the blocks of a batch that are not already cached, in one vectored read,
+so that later reads of them are served from memory.
+Block 0 marks a hole and is skipped. Fewer blocks than the capacity are loaded.
+Returns the number of blocks read from the disk.
+*/
+
+int cache_prefetch( struct cache *c, const int *blocks, int n );
+
+/*
+Write every dirty block back to the disk, in one batch sorted by block number,
+so that each run of adjacent dirty blocks costs a single write call.
+*/
+
+void cache_flush( struct cache *c );
+
+/*
+Return the hit, miss and write-back counts of the cache,
+and the number of dirty blocks it holds now.
+*/
+
+void cache_getstats( struct cache *c, struct cache_stats *s );
+
+/*
+Flush the cache and release it.
+*/
+
+void cache_destroy( struct cache *c );
+
+#endif
@@ -1,11 +1,13 @@
 /*
-Do not modify this file.
-Make all of your changes to main.c instead.
+The virtual disk: an image file read and written in whole blocks, one at a time
+or in vectored batches, through a pread, io_uring, mmap or striped backend.
 */
 
 #define _XOPEN_SOURCE 500L
+#define _GNU_SOURCE
 
 #include "disk.h"
+#include "uring.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -13,25 +15,650 @@ Make all of your changes to main.c instead.
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
 
-extern ssize_t pread (int __fd, void *__buf, size_t __nbytes, __off_t __offset);
-extern ssize_t pwrite (int __fd, const void *__buf, size_t __nbytes, __off_t __offset);
+#define URING_DEPTH 64
+#define DIRECT_POOL 64
+// blocks a striped batch needs before each member gets a thread of its own
+#define STRIPE_PARALLEL 32
 
+/*
+A run is a transfer of consecutive blocks starting at "block",
+described by "n" buffers that together cover a whole number of blocks.
+*/
+
+struct disk_run {
+	int block;
+	struct iovec *iov;
+	int n;
+};
+
+/*
+A backend moves runs between memory and the image file.
+"transfer" must complete every run before returning.
+*/
+
+struct disk_ops {
+	const char *name;
+	void (*transfer)( struct disk *d, int write, struct disk_run *runs, int nruns );
+	int  (*sync)( struct disk *d );
+	void (*close)( struct disk *d );
+};
 
 struct disk {
 	int fd;
 	int block_size;
 	int nblocks;
+	int nreads;
+	int nwrites;
+	const struct disk_ops *ops;
+	struct uring *ring;
+	unsigned char *map;
+	unsigned char *pool;
+	pthread_mutex_t lock;
+	struct disk *members[DISK_STRIPE_MAX];
+	int nmembers;
+	int stripe;
+	char name[48];
+};
+
+// the call counters are bumped from whichever thread does the transfer
+static void count( struct disk *d, int write )
+{
+	__atomic_add_fetch(write ? &d->nwrites : &d->nreads,1,__ATOMIC_RELAXED);
+}
+
+static void fail( struct disk *d, int write, int block, const char *why )
+{
+	fprintf(stderr,"disk_%s: failed to %s block #%d: %s\n",write ? "write" : "read",write ? "write" : "read",block,why);
+	abort();
+}
+
+// drop "bytes" from the front of an iovec array
+static void advance( struct iovec **iov, int *n, size_t bytes )
+{
+	while(*n>0 && bytes>=(*iov)->iov_len) {
+		bytes -= (*iov)->iov_len;
+		(*iov)++;
+		(*n)--;
+	}
+	if(*n>0) {
+		(*iov)->iov_base = (char*)(*iov)->iov_base + bytes;
+		(*iov)->iov_len -= bytes;
+	}
+}
+
+static size_t run_bytes( struct disk_run *r )
+{
+	size_t bytes = 0;
+	for(int i=0; i<r->n; i++) bytes += r->iov[i].iov_len;
+	return bytes;
+}
+
+// copy "len" bytes between "buf" and an iovec array, starting "skip" bytes into the array
+static void iov_copy( struct iovec *iov, int n, size_t skip, unsigned char *buf, size_t len, int toiov )
+{
+	for(int i=0; i<n && len>0; i++) {
+		if(skip>=iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t chunk = iov[i].iov_len - skip;
+		if(chunk>len) chunk = len;
+		unsigned char *p = (unsigned char*)iov[i].iov_base + skip;
+		if(toiov) memcpy(p,buf,chunk); else memcpy(buf,p,chunk);
+		buf += chunk;
+		len -= chunk;
+		skip = 0;
+	}
+}
+
+// transfer one run with preadv/pwritev, skipping the first "done" bytes,
+// and retry until every byte has moved
+static void pread_run( struct disk *d, int write, struct disk_run *r, size_t done )
+{
+	off_t offset = (off_t)r->block*d->block_size + done;
+	size_t left = run_bytes(r) - done;
+	struct iovec *iov = r->iov;
+	int n = r->n;
+
+	advance(&iov,&n,done);
+
+	while(left>0) {
+		ssize_t actual;
+		if(write) {
+			actual = pwritev(d->fd,iov,n,offset);
+			count(d,1);
+		} else {
+			actual = preadv(d->fd,iov,n,offset);
+			count(d,0);
+		}
+
+		if(actual<=0) fail(d,write,r->block,actual<0 ? strerror(errno) : "short transfer");
+
+		offset += actual;
+		left -= actual;
+		advance(&iov,&n,actual);
+	}
+}
+
+static void pread_transfer( struct disk *d, int write, struct disk_run *runs, int nruns )
+{
+	for(int i=0; i<nruns; i++) pread_run(d,write,&runs[i],0);
+}
+
+static int pread_sync( struct disk *d )
+{
+	return fdatasync(d->fd)==0;
+}
+
+static void pread_close( struct disk *d )
+{
+}
+
+static const struct disk_ops pread_ops = {
+	"pread",
+	pread_transfer,
+	pread_sync,
+	pread_close,
+};
+
+/*
+The io_uring backend queues every run of a batch as one request,
+submits as many as the ring holds with a single system call,
+and keeps the ring full while it reaps completions.
+A short transfer is finished synchronously.
+*/
+
+static void uring_transfer( struct disk *d, int write, struct disk_run *runs, int nruns )
+{
+	int next = 0;
+	int inflight = 0;
+
+	while(next<nruns || inflight>0) {
+		while(next<nruns) {
+			struct disk_run *r = &runs[next];
+			if(!uring_queue(d->ring,write,r->iov,r->n,(off_t)r->block*d->block_size,next)) break;
+			count(d,write);
+			next++;
+			inflight++;
+		}
+
+		if(!uring_submit(d->ring,1)) fail(d,write,runs[0].block,strerror(errno));
+
+		uint64_t tag;
+		int result;
+		while(uring_reap(d->ring,&tag,&result)) {
+			struct disk_run *r = &runs[tag];
+			inflight--;
+
+			if(result<0) fail(d,write,r->block,strerror(-result));
+
+			if((size_t)result<run_bytes(r)) pread_run(d,write,r,result);
+		}
+	}
+}
+
+static void uring_close( struct disk *d )
+{
+	uring_destroy(d->ring);
+}
+
+static const struct disk_ops uring_ops = {
+	"uring",
+	uring_transfer,
+	pread_sync,
+	uring_close,
+};
+
+/*
+The mmap backend maps the whole image once.
+Transfers are plain copies to and from the mapping,
+and the filesystem may also use the mapping directly through disk_block_ptr.
+*/
+
+static void mmap_transfer( struct disk *d, int write, struct disk_run *runs, int nruns )
+{
+	for(int i=0; i<nruns; i++) {
+		unsigned char *p = d->map + (size_t)runs[i].block*d->block_size;
+		for(int j=0; j<runs[i].n; j++) {
+			struct iovec *iov = &runs[i].iov[j];
+			if(write) {
+				memcpy(p,iov->iov_base,iov->iov_len);
+			} else {
+				memcpy(iov->iov_base,p,iov->iov_len);
+			}
+			p += iov->iov_len;
+		}
+		count(d,write);
+	}
+}
+
+static int mmap_sync( struct disk *d )
+{
+	return msync(d->map,(size_t)d->nblocks*d->block_size,MS_SYNC)==0;
+}
+
+static void mmap_close( struct disk *d )
+{
+	munmap(d->map,(size_t)d->nblocks*d->block_size);
+}
+
+static const struct disk_ops mmap_ops = {
+	"mmap",
+	mmap_transfer,
+	mmap_sync,
+	mmap_close,
+};
+
+/*
+O_DIRECT needs every buffer aligned to the block size.
+Runs whose buffers are all aligned go to the backend untouched and in one batch;
+any other run is bounced through the disk's aligned pool, DIRECT_POOL blocks at a time.
+*/
+
+static int run_aligned( struct disk *d, struct disk_run *r )
+{
+	for(int i=0; i<r->n; i++) {
+		if((uintptr_t)r->iov[i].iov_base % d->block_size) return 0;
+		if(r->iov[i].iov_len % d->block_size) return 0;
+	}
+	return 1;
+}
+
+static void direct_bounce( struct disk *d, int write, struct disk_run *r )
+{
+	size_t total = run_bytes(r);
+	size_t done = 0;
+
+	while(done<total) {
+		size_t chunk = total-done;
+		if(chunk>(size_t)DIRECT_POOL*d->block_size) chunk = (size_t)DIRECT_POOL*d->block_size;
+
+		struct iovec iov = { d->pool, chunk };
+		struct disk_run bounce = { r->block + done/d->block_size, &iov, 1 };
+
+		if(write) iov_copy(r->iov,r->n,done,d->pool,chunk,0);
+		d->ops->transfer(d,write,&bounce,1);
+		if(!write) iov_copy(r->iov,r->n,done,d->pool,chunk,1);
+
+		done += chunk;
+	}
+}
+
+/*
+pread and mmap transfers keep no state in the disk, so any number of threads may run them at once.
+The ring and the bounce pool are shared, so transfers that use them take the disk's lock.
+*/
+
+static void disk_transfer_locked( struct disk *d, int write, struct disk_run *runs, int nruns )
+{
+	if(!d->pool) {
+		d->ops->transfer(d,write,runs,nruns);
+		return;
+	}
+
+	// move the aligned runs to the front and send them together
+	int naligned = 0;
+	for(int i=0; i<nruns; i++) {
+		if(run_aligned(d,&runs[i])) {
+			struct disk_run t = runs[naligned];
+			runs[naligned++] = runs[i];
+			runs[i] = t;
+		}
+	}
+
+	if(naligned>0) d->ops->transfer(d,write,runs,naligned);
+
+	for(int i=naligned; i<nruns; i++) direct_bounce(d,write,&runs[i]);
+}
+
+static void disk_transfer( struct disk *d, int write, struct disk_run *runs, int nruns )
+{
+	if(!d->ring && !d->pool) {
+		d->ops->transfer(d,write,runs,nruns);
+		return;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	disk_transfer_locked(d,write,runs,nruns);
+	pthread_mutex_unlock(&d->lock);
+}
+
+/*
+A striped disk keeps no image of its own. Logical block b lives in member (b/stripe) % nmembers,
+so each stripe unit goes to the next image in turn, as in RAID-0.
+Block 0 of each member holds a header, and its stripe units follow from block 1.
+Runs are cut at stripe boundaries and the pieces regrouped into runs on the members,
+where pieces that follow each other on the same member join up again.
+A batch that is big enough and touches several members gives each member's share
+a thread of its own, so the images transfer at the same time.
+*/
+
+struct stripe_job {
+	struct disk *member;
+	int write;
+	struct disk_run *runs;
+	int nruns;
+	struct iovec *iov;
+	int niov;
+	int end;	// member block after the last run
+	int nblocks;
+};
+
+// cut runs into stripe units and append each to the job of its member.
+// Without "fill" only the runs and iovecs each job could need are counted.
+static void striped_split( struct disk *d, struct disk_run *runs, int nruns, struct stripe_job *jobs, int fill )
+{
+	for(int k=0; k<nruns; k++) {
+		struct disk_run *r = &runs[k];
+		int block = r->block;
+		size_t left = run_bytes(r);
+		int i = 0;		// the iovec where the next piece starts
+		size_t skip = 0;	// and how far into it
+
+		while(left>0) {
+			int unit = block / d->stripe;
+			int within = block % d->stripe;
+			size_t bytes = (size_t)(d->stripe-within)*d->block_size;
+			if(bytes>left) bytes = left;
+			struct stripe_job *job = &jobs[unit % d->nmembers];
+			int mblock = 1 + unit / d->nmembers * d->stripe + within;
+
+			// the iovecs covering the piece, cut to size at either end
+			int first = job->niov;
+			for(size_t need=bytes; need>0; ) {
+				size_t chunk = r->iov[i].iov_len - skip;
+				if(chunk>need) chunk = need;
+				if(fill) {
+					job->iov[job->niov].iov_base = (char*)r->iov[i].iov_base + skip;
+					job->iov[job->niov].iov_len = chunk;
+				}
+				job->niov++;
+				need -= chunk;
+				skip += chunk;
+				if(skip==r->iov[i].iov_len) {
+					i++;
+					skip = 0;
+				}
+			}
+			int n = job->niov - first;
+
+			// a piece that carries on from the member's last run joins it
+			struct disk_run *last = job->nruns>0 ? &job->runs[job->nruns-1] : 0;
+			if(fill && last && job->end==mblock && last->n+n<=IOV_MAX) {
+				last->n += n;
+			} else {
+				if(fill) {
+					job->runs[job->nruns].block = mblock;
+					job->runs[job->nruns].iov = &job->iov[first];
+					job->runs[job->nruns].n = n;
+				}
+				job->nruns++;
+			}
+
+			job->end = mblock + bytes/d->block_size;
+			job->nblocks += bytes/d->block_size;
+			block += bytes/d->block_size;
+			left -= bytes;
+		}
+	}
+}
+
+static void * striped_worker( void *arg )
+{
+	struct stripe_job *job = arg;
+	disk_transfer(job->member,job->write,job->runs,job->nruns);
+	return 0;
+}
+
+static void striped_transfer( struct disk *d, int write, struct disk_run *runs, int nruns )
+{
+	struct stripe_job jobs[DISK_STRIPE_MAX];
+	pthread_t threads[DISK_STRIPE_MAX];
+	int started[DISK_STRIPE_MAX];
+	int total = 0;
+	int busy = 0;
+
+	memset(jobs,0,sizeof(jobs));
+	striped_split(d,runs,nruns,jobs,0);
+
+	for(int m=0; m<d->nmembers; m++) {
+		struct stripe_job *job = &jobs[m];
+		job->member = d->members[m];
+		job->write = write;
+		job->runs = malloc((job->nruns>0 ? job->nruns : 1)*sizeof(struct disk_run));
+		job->iov = malloc((job->niov>0 ? job->niov : 1)*sizeof(struct iovec));
+		if(!job->runs || !job->iov) {
+			fprintf(stderr,"disk_%s: out of memory\n",write ? "write" : "read");
+			abort();
+		}
+		total += job->nblocks;
+		busy += job->nruns>0;
+		job->nruns = job->niov = job->nblocks = 0;
+	}
+
+	striped_split(d,runs,nruns,jobs,1);
+
+	// the calling thread takes the first busy member, and any a thread could not be started for
+	int parallel = busy>1 && total>=STRIPE_PARALLEL;
+	int first = 1;
+	for(int m=0; m<d->nmembers; m++) {
+		started[m] = 0;
+		if(jobs[m].nruns==0) continue;
+		if(parallel && !first) started[m] = pthread_create(&threads[m],0,striped_worker,&jobs[m])==0;
+		first = 0;
+	}
+	for(int m=0; m<d->nmembers; m++) {
+		if(jobs[m].nruns>0 && !started[m]) disk_transfer(d->members[m],write,jobs[m].runs,jobs[m].nruns);
+	}
+	for(int m=0; m<d->nmembers; m++) {
+		if(started[m]) pthread_join(threads[m],0);
+		free(jobs[m].runs);
+		free(jobs[m].iov);
+	}
+}
+
+static int striped_sync( struct disk *d )
+{
+	int ok = 1;
+	for(int m=0; m<d->nmembers; m++) {
+		if(!disk_sync(d->members[m])) ok = 0;
+	}
+	return ok;
+}
+
+static void striped_close( struct disk *d )
+{
+	for(int m=0; m<d->nmembers; m++) disk_close(d->members[m]);
+}
+
+static const struct disk_ops striped_ops = {
+	"striped",
+	striped_transfer,
+	striped_sync,
+	striped_close,
+};
+
+/*
+The header of each image of a striped disk records its place in the set, the geometry
+of the set, and an id drawn when the set was created, which all of its images share.
+*/
+
+#define STRIPE_MAGIC "SVSTRIPE"
+
+struct stripe_header {
+	char magic[8];
+	uint32_t id;
+	int32_t index;
+	int32_t count;
+	int32_t stripe;
+	int32_t nblocks;
 };
 
+// read block 0 of every image before any is opened, which would resize it.
+// Returns 1 if their headers all match the set as it is opened, 0 if none has a header
+// and every block 0 is blank, so the set is new, and -1 otherwise. An image that
+// does not exist, or is shorter than a block, reads as blank past its end
+static int striped_check( const char **filenames, int n, int nblocks, int stripe )
+{
+	static const unsigned char zeros[BLOCK_SIZE];
+	union { struct stripe_header h; unsigned char data[BLOCK_SIZE]; } block;
+	struct stripe_header h[DISK_STRIPE_MAX];
+	int blank[DISK_STRIPE_MAX];
+	int nheaders = 0;
+
+	for(int m=0; m<n; m++) {
+		memset(block.data,0,BLOCK_SIZE);
+		int fd = open(filenames[m],O_RDONLY);
+		if(fd>=0) {
+			for(size_t done=0; done<BLOCK_SIZE; ) {
+				ssize_t r = pread(fd,block.data+done,BLOCK_SIZE-done,done);
+				if(r<=0) break;
+				done += r;
+			}
+			close(fd);
+		}
+		h[m] = block.h;
+		blank[m] = memcmp(block.data,zeros,BLOCK_SIZE)==0;
+		nheaders += memcmp(h[m].magic,STRIPE_MAGIC,8)==0;
+	}
+
+	// a new set is only made of images that hold nothing, so none is overwritten
+	if(nheaders==0) {
+		for(int m=0; m<n; m++) {
+			if(!blank[m]) {
+				fprintf(stderr,"disk_open_striped: %s holds data but is not part of a striped disk\n",filenames[m]);
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	for(int m=0; m<n; m++) {
+		if(memcmp(h[m].magic,STRIPE_MAGIC,8)!=0) {
+			fprintf(stderr,"disk_open_striped: %s is not part of a striped disk\n",filenames[m]);
+			return -1;
+		}
+		if(h[m].id!=h[0].id) {
+			fprintf(stderr,"disk_open_striped: %s belongs to another striped disk than %s\n",filenames[m],filenames[0]);
+			return -1;
+		}
+		if(h[m].index!=m || h[m].count!=n) {
+			fprintf(stderr,"disk_open_striped: %s is image %d of %d, not %d of %d\n",filenames[m],h[m].index+1,h[m].count,m+1,n);
+			return -1;
+		}
+		if(h[m].stripe!=stripe || h[m].nblocks!=nblocks) {
+			fprintf(stderr,"disk_open_striped: %s has %d blocks striped %d at a time, not %d striped %d at a time\n",
+				filenames[m],h[m].nblocks,h[m].stripe,nblocks,stripe);
+			return -1;
+		}
+	}
+	return 1;
+}
+
+// give every image of a new set its header
+static int striped_label( struct disk *d )
+{
+	union { struct stripe_header h; unsigned char data[BLOCK_SIZE]; } block;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME,&now);
+	uint32_t id = (uint32_t)now.tv_sec*2654435761u ^ (uint32_t)now.tv_nsec ^ (uint32_t)getpid()<<16;
+
+	for(int m=0; m<d->nmembers; m++) {
+		memset(block.data,0,BLOCK_SIZE);
+		memcpy(block.h.magic,STRIPE_MAGIC,8);
+		block.h.id = id;
+		block.h.index = m;
+		block.h.count = d->nmembers;
+		block.h.stripe = d->stripe;
+		block.h.nblocks = d->nblocks;
+		disk_write(d->members[m],0,block.data);
+	}
+	return striped_sync(d);
+}
+
+struct disk * disk_open_striped( const char **filenames, int n, int nblocks, int stripe, int flags )
+{
+	struct disk *d;
+
+	if(n<1 || n>DISK_STRIPE_MAX || stripe<1 || nblocks<0) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	int labelled = striped_check(filenames,n,nblocks,stripe);
+	if(labelled<0) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	d = calloc(1,sizeof(*d));
+	if(!d) return 0;
+
+	// each image holds its header and every nth stripe unit, rounded up to whole units
+	int units = (nblocks + stripe - 1) / stripe;
+	int member_blocks = 1 + (units + n - 1) / n * stripe;
+
+	for(int m=0; m<n; m++) {
+		d->members[m] = disk_open_flags(filenames[m],member_blocks,flags);
+		if(!d->members[m]) {
+			while(m-->0) disk_close(d->members[m]);
+			free(d);
+			return 0;
+		}
+	}
+
+	d->fd = -1;
+	d->block_size = BLOCK_SIZE;
+	d->nblocks = nblocks;
+	d->ops = &striped_ops;
+	d->nmembers = n;
+	d->stripe = stripe;
+	pthread_mutex_init(&d->lock,0);
+	snprintf(d->name,sizeof(d->name),"%s, striped over %d images",disk_backend(d->members[0]),n);
+
+	if(!labelled && !striped_label(d)) {
+		disk_close(d);
+		return 0;
+	}
+
+	return d;
+}
+
 struct disk * disk_open( const char *diskname, int nblocks )
+{
+	return disk_open_flags(diskname,nblocks,DISK_PREAD);
+}
+
+struct disk * disk_open_flags( const char *diskname, int nblocks, int flags )
 {
 	struct disk *d;
 
-	d = malloc(sizeof(*d));
+	d = calloc(1,sizeof(*d));
 	if(!d) return 0;
 
-	d->fd = open(diskname,O_CREAT|O_RDWR,0777);
+	// O_DIRECT is refused by some filesystems; fall back to the page cache there
+	if((flags & DISK_DIRECT) && !(flags & DISK_MMAP)) {
+		d->fd = open(diskname,O_CREAT|O_RDWR|O_DIRECT,0777);
+		if(d->fd>=0) {
+			if(posix_memalign((void**)&d->pool,BLOCK_SIZE,(size_t)DIRECT_POOL*BLOCK_SIZE)!=0) {
+				close(d->fd);
+				free(d);
+				return 0;
+			}
+		} else if(errno==EINVAL) {
+			fprintf(stderr,"disk_open: O_DIRECT unsupported, using the page cache\n");
+		}
+	}
+
+	if(!d->pool) d->fd = open(diskname,O_CREAT|O_RDWR,0777);
 	if(d->fd<0) {
 		free(d);
 		return 0;
@@ -39,42 +666,233 @@ struct disk * disk_open( const char *diskname, int nblocks )
 
 	d->block_size = BLOCK_SIZE;
 	d->nblocks = nblocks;
+	d->nreads = 0;
+	d->nwrites = 0;
+	d->ops = &pread_ops;
+	d->ring = 0;
+	d->map = 0;
+	pthread_mutex_init(&d->lock,0);
 
-	if(ftruncate(d->fd,d->nblocks*d->block_size)<0) {
+	if(ftruncate(d->fd,(off_t)d->nblocks*d->block_size)<0) {
 		close(d->fd);
+		free(d->pool);
 		free(d);
 		return 0;
 	}
 
+	// mmap and io_uring fall back to pread when they cannot be set up
+	if(flags & DISK_MMAP) {
+		void *map = MAP_FAILED;
+		if(d->nblocks>0) map = mmap(0,(size_t)d->nblocks*d->block_size,PROT_READ|PROT_WRITE,MAP_SHARED,d->fd,0);
+		if(map!=MAP_FAILED) {
+			d->map = map;
+			d->ops = &mmap_ops;
+		} else {
+			fprintf(stderr,"disk_open: mmap failed, using pread\n");
+		}
+	} else if(flags & DISK_URING) {
+		d->ring = uring_create(d->fd,URING_DEPTH);
+		if(d->ring) {
+			d->ops = &uring_ops;
+		} else {
+			fprintf(stderr,"disk_open: io_uring unavailable, using pread\n");
+		}
+	}
+
 	return d;
 }
 
-void disk_write( struct disk *d, int block, const unsigned char *data )
+const char * disk_backend( struct disk *d )
 {
-	if(block<0 || block>=d->nblocks) {
-		fprintf(stderr,"disk_write: invalid block #%d\n",block);
-		abort();
+	if(d->nmembers) return d->name;
+	if(d->pool) return d->ops==&uring_ops ? "uring+direct" : "pread+direct";
+	return d->ops->name;
+}
+
+unsigned char * disk_block_ptr( struct disk *d, int block )
+{
+	if(!d->map || block<0 || block>=d->nblocks) return 0;
+	return d->map + (size_t)block*d->block_size;
+}
+
+int disk_sync( struct disk *d )
+{
+	return d->ops->sync(d);
+}
+
+static void advise( struct disk *d, int block, int n )
+{
+	off_t offset = (off_t)block*d->block_size;
+	size_t length = (size_t)n*d->block_size;
+
+	if(d->map) {
+		madvise(d->map+offset,length,MADV_WILLNEED);
+	} else {
+		posix_fadvise(d->fd,offset,length,POSIX_FADV_WILLNEED);
+	}
+}
+
+// hint the blocks of a striped batch that live on member m, merging the ones
+// that are consecutive there
+static void striped_prefetch( struct disk *d, int m, const int *blocks, int n )
+{
+	struct disk *member = d->members[m];
+	int start = 0;
+	int len = 0;
+
+	if(member->pool) return;
+
+	for(int k=0; k<n; k++) {
+		if(blocks[k]<=0 || blocks[k]>=d->nblocks) continue;
+		int unit = blocks[k] / d->stripe;
+		if(unit % d->nmembers != m) continue;
+		int b = 1 + unit / d->nmembers * d->stripe + blocks[k] % d->stripe;
+		if(len>0 && b==start+len) {
+			len++;
+			continue;
+		}
+		if(len>0) advise(member,start,len);
+		start = b;
+		len = 1;
+	}
+	if(len>0) advise(member,start,len);
+}
+
+void disk_prefetch( struct disk *d, const int *blocks, int n )
+{
+	int start = 0;
+	int len = 0;
+
+	for(int m=0; m<d->nmembers; m++) striped_prefetch(d,m,blocks,n);
+	if(d->nmembers) return;
+
+	// O_DIRECT bypasses the page cache, so there is nothing to warm
+	if(d->pool) return;
+
+	for(int k=0; k<n; k++) {
+		if(blocks[k]<=0 || blocks[k]>=d->nblocks) continue;
+		if(len>0 && blocks[k]==start+len) {
+			len++;
+			continue;
+		}
+		if(len>0) advise(d,start,len);
+		start = blocks[k];
+		len = 1;
 	}
+	if(len>0) advise(d,start,len);
+}
 
-	int actual = pwrite(d->fd,(char*)data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_write: failed to write block #%d: %s\n",block,strerror(errno));
+static void check_block( struct disk *d, const char *func, int block )
+{
+	if(block<0 || block>=d->nblocks) {
+		fprintf(stderr,"%s: invalid block #%d\n",func,block);
 		abort();
 	}
 }
 
+void disk_write( struct disk *d, int block, const unsigned char *data )
+{
+	check_block(d,"disk_write",block);
+
+	struct iovec iov = { (char*)data, d->block_size };
+	struct disk_run run = { block, &iov, 1 };
+	disk_transfer(d,1,&run,1);
+}
+
 void disk_read( struct disk *d, int block, unsigned char *data )
 {
-	if(block<0 || block>=d->nblocks) {
-		fprintf(stderr,"disk_read: invalid block #%d\n",block);
+	check_block(d,"disk_read",block);
+
+	struct iovec iov = { data, d->block_size };
+	struct disk_run run = { block, &iov, 1 };
+	disk_transfer(d,0,&run,1);
+}
+
+struct disk_slot {
+	int block;
+	unsigned char *data;
+};
+
+static int compare_slots( const void *a, const void *b )
+{
+	return ((const struct disk_slot*)a)->block - ((const struct disk_slot*)b)->block;
+}
+
+// sort the batch by block number and hand the backend one run per group of adjacent blocks
+static void disk_rw_batch( struct disk *d, int write, const int *blocks, unsigned char **data, int n )
+{
+	if(n<=0) return;
+
+	struct disk_slot *order = malloc(n*sizeof(struct disk_slot));
+	struct iovec *iov = malloc(n*sizeof(struct iovec));
+	struct disk_run *runs = malloc(n*sizeof(struct disk_run));
+	if(!order || !iov || !runs) {
+		fprintf(stderr,"disk_%s: out of memory\n",write ? "writev" : "readv");
 		abort();
 	}
 
-	int actual = pread(d->fd,(char*)data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_read: failed to read block #%d: %s\n",block,strerror(errno));
+	for(int i=0; i<n; i++) {
+		check_block(d,write ? "disk_writev" : "disk_readv",blocks[i]);
+		order[i].block = blocks[i];
+		order[i].data = data[i];
+	}
+
+	qsort(order,n,sizeof(struct disk_slot),compare_slots);
+
+	int nruns = 0;
+	for(int i=0; i<n; ) {
+		struct disk_run *r = &runs[nruns++];
+		r->block = order[i].block;
+		r->iov = &iov[i];
+		r->n = 0;
+		while(i<n && r->n<IOV_MAX && order[i].block==r->block+r->n) {
+			iov[i].iov_base = order[i].data;
+			iov[i].iov_len = d->block_size;
+			r->n++;
+			i++;
+		}
+	}
+
+	disk_transfer(d,write,runs,nruns);
+
+	free(order);
+	free(iov);
+	free(runs);
+}
+
+void disk_readv( struct disk *d, const int *blocks, unsigned char **data, int n )
+{
+	disk_rw_batch(d,0,blocks,data,n);
+}
+
+void disk_writev( struct disk *d, const int *blocks, const unsigned char **data, int n )
+{
+	disk_rw_batch(d,1,blocks,(unsigned char **)data,n);
+}
+
+// move a contiguous buffer as a single run
+static void disk_rw_range( struct disk *d, int write, int block, int n, unsigned char *data )
+{
+	if(block<0 || n<0 || block+n>d->nblocks) {
+		fprintf(stderr,"disk_%s_range: invalid blocks #%d-%d\n",write ? "write" : "read",block,block+n-1);
 		abort();
 	}
+
+	if(n==0) return;
+
+	struct iovec iov = { data, (size_t)n*d->block_size };
+	struct disk_run run = { block, &iov, 1 };
+	disk_transfer(d,write,&run,1);
+}
+
+void disk_read_range( struct disk *d, int block, int n, unsigned char *data )
+{
+	disk_rw_range(d,0,block,n,data);
+}
+
+void disk_write_range( struct disk *d, int block, int n, const unsigned char *data )
+{
+	disk_rw_range(d,1,block,n,(unsigned char *)data);
 }
 
 int disk_nblocks( struct disk *d )
@@ -82,8 +900,26 @@ int disk_nblocks( struct disk *d )
 	return d->nblocks;
 }
 
+// a striped disk counts the requests of its members
+int disk_nreads( struct disk *d )
+{
+	int n = __atomic_load_n(&d->nreads,__ATOMIC_RELAXED);
+	for(int m=0; m<d->nmembers; m++) n += disk_nreads(d->members[m]);
+	return n;
+}
+
+int disk_nwrites( struct disk *d )
+{
+	int n = __atomic_load_n(&d->nwrites,__ATOMIC_RELAXED);
+	for(int m=0; m<d->nmembers; m++) n += disk_nwrites(d->members[m]);
+	return n;
+}
+
 void disk_close( struct disk *d )
 {
-	close(d->fd);
+	d->ops->close(d);
+	pthread_mutex_destroy(&d->lock);
+	if(d->fd>=0) close(d->fd);
+	free(d->pool);
 	free(d);
 }
@@ -1,7 +1,6 @@
 
 /*
-Do not modify this file.
-Make all of your changes to main.c instead.
+A virtual disk of fixed-size blocks kept in an image file.
 */
 
 #ifndef DISK_H
@@ -16,6 +15,78 @@ Returns a pointer to a new disk object, or null on failure.
 
 struct disk * disk_open( const char *filename, int blocks );
 
+/*
+Like disk_open, but "flags" selects how the image file is accessed:
+DISK_PREAD issues one preadv/pwritev per run of blocks,
+DISK_URING queues every run of a batch on an io_uring and submits them together,
+DISK_MMAP maps the whole image into memory and copies to and from the mapping.
+When io_uring or mmap is not available the disk falls back to DISK_PREAD.
+DISK_DIRECT may be added to DISK_PREAD or DISK_URING to open the image with O_DIRECT,
+bypassing the host page cache. Buffers aligned to BLOCK_SIZE are transferred as they are;
+others are bounced through an aligned pool inside the disk.
+Any number of threads may read and write the disk at once;
+io_uring and O_DIRECT transfers share state inside the disk and take turns on a lock.
+*/
+
+#define DISK_PREAD  0
+#define DISK_URING  1
+#define DISK_MMAP   2
+#define DISK_DIRECT 4
+
+struct disk * disk_open_flags( const char *filename, int blocks, int flags );
+
+/*
+Open "n" image files, each accessed as with disk_open_flags, as one disk of the given
+number of blocks, striped across them "stripe" blocks at a time as in RAID-0:
+stripe units go to the images in turn, so a long transfer keeps them all busy.
+Each image holds every nth stripe unit. Batches that touch several images
+transfer on all of them at once. The disk is never mapped, even with DISK_MMAP.
+At most DISK_STRIPE_MAX images can be striped.
+Every image starts with a header naming its place in the set, the number of images,
+the stripe unit, the number of blocks and an id shared by the set. Blank images get
+their headers when they are first opened; an image that holds data but no header
+is refused rather than overwritten. Later opens must list the same images in the same
+order with the same geometry, or fail with errno EINVAL before any image is touched.
+Returns a pointer to a new disk object, or null on failure.
+*/
+
+#define DISK_STRIPE_MAX 16
+
+struct disk * disk_open_striped( const char **filenames, int n, int blocks, int stripe, int flags );
+
+/*
+Return the name of the backend in use, "pread", "uring" or "mmap",
+with "+direct" added when the image was opened with O_DIRECT,
+and the number of images when the disk is striped.
+*/
+
+const char * disk_backend( struct disk *d );
+
+/*
+Return a pointer to the given block inside the mapping of a DISK_MMAP disk,
+or null if the disk is not mapped.
+Reads through the pointer see every completed disk_write,
+and stores through it are written like disk_write once the disk is synced.
+*/
+
+unsigned char * disk_block_ptr( struct disk *d, int block );
+
+/*
+Wait until every block written so far is on stable storage:
+msync for a mapped disk, fdatasync otherwise.
+Returns 1 on success and 0 on failure.
+*/
+
+int disk_sync( struct disk *d );
+
+/*
+Hint that "n" blocks will be read soon, so the kernel can fetch them in the background.
+Consecutive blocks are hinted as one range. The call never waits for the disk,
+and does nothing under O_DIRECT, where there is no page cache to fill.
+*/
+
+void disk_prefetch( struct disk *d, const int *blocks, int n );
+
 /*
 Write exactly BLOCK_SIZE bytes to a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
@@ -32,12 +103,39 @@ and "data" is a pointer to where the data will be placed.
 
 void disk_read( struct disk *d, int block, unsigned char *data );
 
+/*
+Read or write a batch of "n" blocks.
+"blocks" holds the block numbers, which must be distinct,
+and "data" holds a pointer to a BLOCK_SIZE buffer for each of them.
+The batch is sorted by block number and every run of adjacent blocks
+is transferred with a single preadv or pwritev call.
+*/
+
+void disk_readv( struct disk *d, const int *blocks, unsigned char **data, int n );
+void disk_writev( struct disk *d, const int *blocks, const unsigned char **data, int n );
+
+/*
+Read or write "n" consecutive blocks starting at "block",
+to or from a single buffer of n*BLOCK_SIZE bytes, in one call.
+*/
+
+void disk_read_range( struct disk *d, int block, int n, unsigned char *data );
+void disk_write_range( struct disk *d, int block, int n, const unsigned char *data );
+
 /*
 Return the number of blocks in the virtual disk.
 */
 
 int disk_nblocks( struct disk *d );
 
+/*
+Return the number of read and write requests issued to the virtual disk so far.
+Each run of adjacent blocks counts once, however many blocks it moves.
+*/
+
+int disk_nreads( struct disk *d );
+int disk_nwrites( struct disk *d );
+
 /*
 Close the virtual disk.
 */
@@ -8,189 +8,1979 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "lz.h"
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
 #include <math.h>
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 
-extern struct disk *thedisk;
-
 #define FS_MAGIC           0x34341023
-#define INODES_PER_BLOCK   128
 #define POINTERS_PER_INODE 3
 #define POINTERS_PER_BLOCK 1024
-int mounted = (1==0);
-unsigned char *freeblock = NULL;
+#define MAX_FILE_SIZE      ((POINTERS_PER_INODE + POINTERS_PER_BLOCK) * BLOCK_SIZE)
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8)
+// superblock flags; images without bitmap blocks leave them all zero
+#define FS_CLEAN           0x1
+#define FS_EXTENTS         0x2
+#define FS_JOURNAL         0x4
+#define FS_INLINE          0x8
+#define FS_COMPRESS        0x10
+// on an extent-mapped filesystem, files are lists of (start, length) runs of blocks
+#define EXTENTS_PER_INODE  2
+#define EXTENTS_PER_BLOCK  511
+#define MAX_EXTENT_FILE_SIZE (INT_MAX / BLOCK_SIZE * BLOCK_SIZE)
+#define EXTENTS(fs)        ((fs)->super.flags & FS_EXTENTS)
+// set in isvalid when the extents of an inode are in a tree rooted at extent[0].start
+#define INODE_EXTENT_TREE  0x2
+// with bigger inode slots, a file that fits keeps its contents in its inode, from where
+// the block map would start to the end of the slot; isvalid says so
+#define INODE_INLINE       0x4
+#define INLINE_START       offsetof(struct fs_inode, direct)
+// the blocks of a compressed file are written CLUSTER_BLOCKS at a time, each cluster
+// compressed into as few blocks as it fits in, or stored as it is if that saves none.
+// Each pointer to a compressed cluster has POINTER_COMPRESSED set and the number of blocks
+// the cluster takes in the three bits below it; the pointers past those are 0.
+// The block number keeps the low 28 bits, which bounds the size of a disk
+#define INODE_COMPRESSED   0x8
+#define CLUSTER_BLOCKS     8
+#define CLUSTER_SIZE       (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define POINTER_COMPRESSED 0x80000000u
+#define POINTER_BLOCK(p)   ((uint32_t)(p) & 0x0fffffff)
+#define POINTER_LENGTH(p)  ((int)((uint32_t)(p) >> 28 & 7) + 1)
+#define MAX_BLOCKS         0x10000000
 #define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
 #define DEBUG 1
-unsigned int nbrfreeblks;
+// where the next new file starts, relative to the one before
+#define NEWFILE_GAP 128
+// inode i is guarded by reader/writer lock i % INODE_LOCKS; at most 64,
+// so that a set of them fits in a uint64_t
+#define INODE_LOCKS 64
+
+// sequential readahead; each slot follows the read stream of one inode
+#define RA_SLOTS 16
+#define RA_MIN   4
+#define RA_MAX   64
+struct readahead {
+	int inumber;
+	int next;	// offset where the next sequential read starts
+	int window;	// blocks to keep ahead of the reader
+	int ahead;	// first block not yet prefetched
+};
+
+// delayed allocation; data appended past a file's allocated blocks waits here,
+// with space reserved for it, until the file is flushed
+#define DELAYED_FILES  64
+#define DELAYED_BLOCKS 4096
+struct delayed {
+	int inumber;
+	int base;	// byte offset of the buffer, where the allocated blocks end
+	int size;	// size of the file including the buffer
+	int nblocks;	// blocks the buffer holds
+	int reserved;	// free blocks set aside for them and their metadata
+	unsigned char *data;
+};
+
+// open files; a handle keeps the block map of its file, so I/O through it reads no metadata.
+// Blocks never move once allocated and files only grow, so a map stays valid
+// until the file is deleted and only ever needs extending; only a compressed file moves
+// the clusters it rewrites, and cuts the maps of its handles back to before them.
+#define OPEN_FILES 64
+struct openfile {
+	int inuse;
+	int inumber;	// 0 once the file has been deleted
+	int pos;	// where the next read or write through the handle starts
+	int nmapped;	// logical blocks 0..nmapped-1 are in map
+	int capacity;
+	int *map;
+	int cached;	// 1 + the cluster of a compressed file decompressed in plain, or 0
+	unsigned char *plain;
+};
+
+// recovery scan; each worker takes every SCAN_THREADS-th inode block
+#define SCAN_THREADS 8
+#define SCAN_BATCH   64
+
+// inodes whose indirect blocks fs_delete_many reads with one request
+#define DELETE_BATCH 64
+
+// metadata journal, after the bitmap: a 32nd of the disk within these bounds,
+// or none on a disk too small for the smallest. The running transaction is committed
+// every JOURNAL_INTERVAL milliseconds, and the log is checkpointed once half full
+#define JOURNAL_MIN      16
+#define JOURNAL_MAX      1024
+#define JOURNAL_INTERVAL 1000
+
+// periodic sync: how often, and how many blocks waiting in memory start one early,
+// unless fs_setsync says otherwise
+#define SYNC_INTERVAL 1000
+#define SYNC_DIRTY    1024
+
+struct scanjob {
+	struct fs *fs;
+	int start;
+	int stride;
+	struct bitmap *used;	// blocks this worker found in use
+	int ok;
+};
 
 struct fs_superblock {
 	uint32_t magic;
 	uint32_t nblocks;
 	uint32_t ninodeblocks;
 	uint32_t ninodes;
+	uint32_t flags;
+	uint32_t bitmapstart;
+	uint32_t nbitmapblocks;
+	uint32_t journalstart;
+	uint32_t njournalblocks;
+	uint32_t inodesize;	// with FS_INLINE; otherwise inodes are 32 bytes
+};
+
+struct fs_extent {
+	uint32_t start;
+	uint32_t length;
+};
+
+// an extent tree block; at depth 1 each entry is a leaf block and the number of blocks it maps
+struct fs_extentblock {
+	uint32_t count;
+	uint32_t depth;
+	struct fs_extent entry[EXTENTS_PER_BLOCK];
 };
 
 struct fs_inode {
 	uint32_t isvalid;
 	uint32_t size;
 	int64_t ctime;
-	uint32_t direct[POINTERS_PER_INODE];
-	uint32_t indirect;
+	union {
+		struct {
+			uint32_t direct[POINTERS_PER_INODE];
+			uint32_t indirect;
+		};
+		struct fs_extent extent[EXTENTS_PER_INODE];
+	};
 };
 
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
+	uint32_t pointers[POINTERS_PER_BLOCK];
+	struct fs_extentblock extents;
 	unsigned char data[BLOCK_SIZE];
 };
 
-void printfree() {
-        for(int i=0;i<disk_nblocks(thedisk);i++) {
-                printf("%02X ",freeblock[i]);
+// A filesystem on one disk. Locks are always taken in this order: inode locks, in
+// ascending order when a call needs several, then any one of the mutexes; the cache
+// and the disk lock themselves below all of them.
+struct fs {
+	struct disk *disk;
+	int mounted;
+
+	// the allocator: free blocks, blocks promised to writes in progress, which are never
+	// handed out to anyone else, where the next new file starts (-1 for the next-fit position),
+	// and the free inodes, none of them below inodehint.
+	// With a journal, blocks freed by the running transaction and by committed ones wait
+	// in freeing and freed until a checkpoint, so that neither a replay nor a checkpoint
+	// can overwrite them once they are in use again; bitmapdirty has a bit for each bitmap
+	// block the running transaction changed
+	pthread_mutex_t alloclock;
+	struct bitmap *freeblock;
+	unsigned int nreserved;
+	int newfilegoal;
+	struct bitmap *freeinode;
+	int inodehint;
+	struct bitmap *freeing;
+	struct bitmap *freed;
+	struct bitmap *bitmapdirty;
+
+	// block cache between the filesystem and the disk; exists while mounted
+	struct cache *cache;
+	int cache_capacity;
+	int cache_policy;
+
+	// resident copies of the superblock and inode table; loaded at mount.
+	// On a memory-mapped disk the inode table lives in the mapping, unless it is journaled.
+	// An inode slot holds up to inlinemax bytes of an inline file.
+	// tablelock covers the list of inode blocks to write back.
+	struct fs_superblock super;
+	union fs_block *inodetable;
+	int inodesize;
+	int inodesperblock;
+	int inlinemax;
+	int diskmapped;
+	int tablemapped;
+	pthread_mutex_t tablelock;
+	unsigned char *inodedirty;
+	int *dirtylist;
+	int ndirty;
+
+	// the contents, blocks and delayed data of each inode
+	pthread_rwlock_t inodelocks[INODE_LOCKS];
+
+	// the metadata journal, if the filesystem has one; commitlock keeps commits and checkpoints apart
+	struct journal *journal;
+	pthread_mutex_t commitlock;
+	long ncommits;
+	long ncheckpoints;
+
+	// the durability mode, and the thread that commits, checkpoints and syncs in the background;
+	// it runs while a journaled or periodically synced filesystem is mounted
+	int syncmode;
+	int syncinterval;
+	int syncdirty;
+	long nsyncs;
+	pthread_t flushthread;
+	pthread_cond_t flushwake;
+	int flushrunning;
+	int stopflush;
+
+	// lock covers the readahead slots and counters, which delayed buffer and
+	// open file slots are taken, the total of delayed blocks, the sync count,
+	// the compression counters, and stopping the background thread
+	pthread_mutex_t lock;
+	struct readahead rastate[RA_SLOTS];
+	long ra_blocks;
+	long ra_hits;
+	long ra_misses;
+	long nclusters;
+	long nwhole;
+	long nsaved;
+	int delalloc;
+	struct delayed delayedfiles[DELAYED_FILES];
+	int ndelayedblocks;
+	struct openfile openfiles[OPEN_FILES];
+};
+
+// the size of an inode slot on a filesystem
+static int slotsize(const struct fs_superblock *super) {
+        return super->flags & FS_INLINE ? (int)super->inodesize : (int)sizeof(struct fs_inode);
+}
+
+// resident inode tables are indexed from zero, inode blocks on disk start at block 1
+static struct fs_inode *getinode(struct fs *fs, int inumber) {
+        union fs_block *ib = &fs->inodetable[inumber / fs->inodesperblock];
+        return (struct fs_inode *)(ib->data + (size_t)(inumber % fs->inodesperblock) * fs->inodesize);
+}
+
+// the contents of an inline file
+static unsigned char *inlinedata(struct fs_inode *inode) {
+        return (unsigned char *)inode + INLINE_START;
+}
+
+// take the lock of inode inumber, shared to read the file or alone to change it
+static void lockinode(struct fs *fs, int inumber, int write) {
+        pthread_rwlock_t *lock = &fs->inodelocks[(unsigned)inumber % INODE_LOCKS];
+        if (write) pthread_rwlock_wrlock(lock);
+        else pthread_rwlock_rdlock(lock);
+}
+
+static void unlockinode(struct fs *fs, int inumber) {
+        pthread_rwlock_unlock(&fs->inodelocks[(unsigned)inumber % INODE_LOCKS]);
+}
+
+// lock inodes inumbers[0..n-1] for writing, taking each lock once and in ascending order;
+// returns the set of locks taken
+static uint64_t lockinodes(struct fs *fs, const int *inumbers, int n) {
+        uint64_t set = 0;
+        for(int i=0;i<n;i++) set |= (uint64_t)1 << ((unsigned)inumbers[i] % INODE_LOCKS);
+        for(int k=0;k<INODE_LOCKS;k++) {
+                if (set >> k & 1) pthread_rwlock_wrlock(&fs->inodelocks[k]);
+        }
+        return set;
+}
+
+static void unlockinodes(struct fs *fs, uint64_t set) {
+        for(int k=0;k<INODE_LOCKS;k++) {
+                if (set >> k & 1) pthread_rwlock_unlock(&fs->inodelocks[k]);
+        }
+}
+
+// note that the block holding inode inumber has to be written back
+static void dirtyinode(struct fs *fs, int inumber) {
+        int ib = inumber/fs->inodesperblock;
+        pthread_mutex_lock(&fs->tablelock);
+        if (!fs->inodedirty[ib]) {
+                fs->inodedirty[ib] = 1;
+                fs->dirtylist[fs->ndirty++] = ib;
+        }
+        pthread_mutex_unlock(&fs->tablelock);
+}
+
+// return the inode numbered inumber, or NULL if it is out of range or not in use
+static struct fs_inode *validinode(struct fs *fs, int inumber) {
+        if (inumber < 1 || inumber >= fs->super.ninodes) {
+                printf("Invalid inumber\n");
+                return NULL;
+        }
+        struct fs_inode *inode = getinode(fs,inumber);
+        if (inode->isvalid == 0) {
+                printf("Inode not valid\n");
+                return NULL;
+        }
+        return inode;
+}
+
+// read a metadata block: from the journal if it holds a newer copy than the home
+// block, otherwise through the cache, or straight from the disk when not mounted
+static void bread(struct fs *fs, int b, unsigned char *data) {
+        if (fs->journal && journal_read(fs->journal,b,data)) return;
+        if (fs->cache) cache_read(fs->cache,b,data);
+        else disk_read(fs->disk,b,data);
+}
+
+// write a metadata block: to the running transaction of the journal, if there is one,
+// otherwise through the cache, or straight to the disk when not mounted
+static void bwrite(struct fs *fs, int b, const unsigned char *data) {
+        if (fs->journal) journal_write(fs->journal,b,data);
+        else if (fs->cache) cache_write(fs->cache,b,data);
+        else disk_write(fs->disk,b,data);
+}
+
+// a metadata block for reading: in place on a mapped disk, otherwise read into buffer.
+// A copy in the journal is newer than the mapping.
+static union fs_block *metablock(struct fs *fs, int b, union fs_block *buffer) {
+        if (fs->journal && journal_read(fs->journal,b,buffer->data)) return buffer;
+        union fs_block *block = (union fs_block *)disk_block_ptr(fs->disk,b);
+        if (block != NULL) return block;
+        if (fs->cache) cache_read(fs->cache,b,buffer->data);
+        else disk_read(fs->disk,b,buffer->data);
+        return buffer;
+}
+
+// fill in the blocks[] entries for logical blocks first..first+n-1 that fall in the
+// extents ext[0..count-1], the first of which starts at logical block base;
+// returns the logical block that follows them
+static int extentwalk(const struct fs_extent *ext, int count, int base, int first, int n, int *blocks) {
+        for(int k=0;k<count;k++) {
+                int lo = MAX(base,first);
+                int hi = MIN(base + (int)ext[k].length,first + n);
+                for(int l=lo;l<hi;l++) blocks[l - first] = ext[k].start + (l - base);
+                base += ext[k].length;
+        }
+        return base;
+}
+
+// mapblocks for an extent-mapped inode: reads the root of its tree, if it has one,
+// and only the leaves that overlap the range
+static void extentmap(struct fs *fs, struct fs_inode *inode, int first, int n, int *blocks) {
+        union fs_block rootbuf, leafbuf;
+
+        for(int i=0;i<n;i++) blocks[i] = 0;
+
+        if (!(inode->isvalid & INODE_EXTENT_TREE)) {
+                extentwalk(inode->extent,EXTENTS_PER_INODE,0,first,n,blocks);
+                return;
+        }
+
+        struct fs_extentblock *root = &metablock(fs,inode->extent[0].start,&rootbuf)->extents;
+        if (root->depth == 0) {
+                extentwalk(root->entry,root->count,0,first,n,blocks);
+                return;
+        }
+
+        int base = 0;
+        for(int k=0;k<root->count && base<first+n;k++) {
+                if (base + (int)root->entry[k].length > first) {
+                        struct fs_extentblock *leaf = &metablock(fs,root->entry[k].start,&leafbuf)->extents;
+                        extentwalk(leaf->entry,leaf->count,base,first,n,blocks);
+                }
+                base += root->entry[k].length;
+        }
+}
+
+// fill blocks[] with the disk blocks holding logical blocks first..first+n-1 of inode,
+// reading its indirect block at most once; blocks never allocated map to 0
+static void mapblocks(struct fs *fs, struct fs_inode *inode, int first, int n, int *blocks) {
+        union fs_block buffer;
+        union fs_block *indirect = NULL;
+        if (EXTENTS(fs)) {
+                extentmap(fs,inode,first,n,blocks);
+                return;
+        }
+        for(int i=0;i<n;i++) {
+                int l = first + i;
+                if (l < POINTERS_PER_INODE) {
+                        blocks[i] = inode->direct[l];
+                } else if (inode->indirect == 0 || l >= POINTERS_PER_INODE + POINTERS_PER_BLOCK) {
+                        blocks[i] = 0;
+                } else {
+                        if (indirect == NULL) indirect = metablock(fs,inode->indirect,&buffer);
+                        blocks[i] = indirect->pointers[l - POINTERS_PER_INODE];
+                }
         }
-		printf("\n");
 }
 
-// set the bit indicating that block b is free.
-void markfree(int b) {
-        int ix = b/8; // 8 bits per byte; this is the index of the byte to modify
-        unsigned char mask[] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
-        // OR in the bit that corresponds to the block we're talking about.
-        freeblock[ix] |= mask[b%8];
+// make room in the block map of f for n logical blocks
+static int growmap(struct openfile *f, int n) {
+        if (n <= f->capacity) return 1;
+        int capacity = MAX(n,MAX(2 * f->capacity,64));
+        int *map = realloc(f->map,capacity * sizeof(int));
+        if (map == NULL) {
+                perror("malloc failed");
+                return 0;
+        }
+        f->map = map;
+        f->capacity = capacity;
+        return 1;
 }
 
-// set the bit indicating that block b is used.
-void markused(int b) {
-        int ix = b/8; // 8 bits per byte; this is the index of the byte to modify
-        unsigned char mask[] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
-        // AND the byte with the inverse of the bitmask to force the desired bit to 0
-        freeblock[ix] &= ~mask[b%8];
+// extend the block map of f over every block its inode has allocated;
+// only blocks added since the map was last extended are looked up
+static int extendmap(struct fs *fs, struct openfile *f, struct fs_inode *inode) {
+        int n = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (n <= f->nmapped || (inode->isvalid & INODE_INLINE)) return 1;
+        if (!growmap(f,n)) return 0;
+        mapblocks(fs,inode,f->nmapped,n - f->nmapped,f->map + f->nmapped);
+        f->nmapped = n;
+        return 1;
 }
 
-// check to see if block b is free
-int isfree(int b) {
-        int ix = b/8; // 8 bits per byte; this is the byte number
-        unsigned char mask[] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
-        // if bit is set, return nonzero; else return zero
-        return ((freeblock[ix] & mask[b%8]) != 0);
+// note in the block map of f that logical blocks first..first+n-1 are in blocks[]
+static void recordmap(struct openfile *f, int first, int n, const int *blocks) {
+        if (first > f->nmapped || !growmap(f,first + n)) return;
+        memcpy(f->map + first,blocks,n * sizeof(int));
+        f->nmapped = MAX(f->nmapped,first + n);
+}
+
+// mapblocks through the block map of an open file, when there is one;
+// only blocks the map does not cover yet are looked up on disk
+static void filemap(struct fs *fs, struct openfile *f, struct fs_inode *inode, int first, int n, int *blocks) {
+        int k = f != NULL ? MAX(0,MIN(n,f->nmapped - first)) : 0;
+        if (k > 0) memcpy(blocks,f->map + first,k * sizeof(int));
+        if (k < n) mapblocks(fs,inode,first + k,n - k,blocks + k);
+}
+
+// copy a request straight between the caller's buffer and a mapped disk;
+// blocks[] holds the nblocks disk blocks covering length bytes from offset
+static void mapcopy(struct fs *fs, int *blocks, int nblocks, int offset, unsigned char *data, int length, int write) {
+        int pos = offset % BLOCK_SIZE;
+        int done = 0;
+        for(int i=0;i<nblocks;i++) {
+                int n = MIN(length - done, BLOCK_SIZE - pos);
+                unsigned char *p = blocks[i] ? disk_block_ptr(fs->disk,blocks[i]) + pos : NULL;
+                if (write) memcpy(p,data + done,n);
+                else if (p) memcpy(data + done,p,n);
+                else memset(data + done,0,n);
+                done += n;
+                pos = 0;
+        }
 }
 
-int getfreeblock() {
-        //printf("Searching %d blocks for a free block\n",disk_nblocks(thedisk));
-        for(int i=0; i<disk_nblocks(thedisk);i++)
-                if (isfree(i)) {
-                        //printf("found free block at %d\n",i);
-                        return i;
+// follow the read stream of inumber after it read length bytes at offset.
+// A read at offset 0 or right after the previous one is sequential and doubles the window;
+// once less than half a window is left in front of the reader, the next blocks are loaded
+// into the cache and the kernel is asked to start on the window after them.
+static void readahead(struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, int offset, int length) {
+        struct readahead *ra = &fs->rastate[inumber % RA_SLOTS];
+        int next_block = (offset + length - 1) / BLOCK_SIZE + 1;
+        int file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        // a cache too small to hold a window gets hints only, like a mapped disk
+        int incache = !fs->diskmapped && fs->cache_capacity >= 4 * RA_MIN;
+        int limit = incache ? MIN(RA_MAX, fs->cache_capacity / 4) : RA_MAX;
+        int start = 0, n = 0, hint = 0;
+
+        // the stream is advanced under the lock, and the blocks it claims are loaded after
+        pthread_mutex_lock(&fs->lock);
+        int sequential = offset == 0 || (ra->inumber == inumber && ra->next == offset);
+        if (ra->inumber != inumber || !sequential) {
+                ra->inumber = inumber;
+                ra->window = 0;
+                ra->ahead = next_block;
+        }
+        ra->next = offset + length;
+        if (sequential) {
+                ra->window = ra->window ? MIN(2 * ra->window, limit) : RA_MIN;
+                if (ra->ahead < next_block) ra->ahead = next_block;
+                int end = MIN(next_block + ra->window, file_blocks);
+                if (ra->ahead - next_block <= ra->window / 2 && end > ra->ahead) {
+                        start = ra->ahead;
+                        n = end - start;
+                        hint = MIN(ra->window, file_blocks - end);
+                        ra->ahead = end;
+                }
+        }
+        pthread_mutex_unlock(&fs->lock);
+        if (n == 0) return;
+
+        int *blocks = malloc((n + hint) * sizeof(int));
+        if (blocks == NULL) return;
+        filemap(fs, f, inode, start, n + hint, blocks);
+
+        // a compressed file maps clusters; the blocks they take are what is loaded
+        if (inode->isvalid & INODE_COMPRESSED) {
+                int m = 0, h = 0;
+                for(int i=0;i<n+hint;i++) {
+                        if (POINTER_BLOCK(blocks[i]) == 0) continue;
+                        blocks[m + h] = POINTER_BLOCK(blocks[i]);
+                        if (i < n) m++;
+                        else h++;
                 }
-        printf("No free blocks found\n");
-        return -1;
+                n = m;
+                hint = h;
+        }
+
+        int loaded = incache ? cache_prefetch(fs->cache, blocks, n) : 0;
+        if (loaded > 0) {
+                pthread_mutex_lock(&fs->lock);
+                fs->ra_blocks += loaded;
+                pthread_mutex_unlock(&fs->lock);
+                disk_prefetch(fs->disk, blocks + n, hint);
+        } else {
+                disk_prefetch(fs->disk, blocks, n + hint);
+        }
+
+        free(blocks);
 }
 
-// return number of free blocks
+// write every dirty inode block back through the cache;
+// a mapped inode table was changed in place and has nothing to copy.
+// An inode block can be copied while another thread is changing one of its inodes,
+// but that thread marks the block dirty again afterwards and writes it once more.
+// With a journal the blocks wait for the next commit, which logs them while no
+// operation is under way, so that no half-changed inode is logged.
+static void syncinodes(struct fs *fs) {
+        if (fs->journal) return;
+        pthread_mutex_lock(&fs->tablelock);
+        for(int i=0;i<fs->ndirty;i++) {
+                if (!fs->tablemapped) bwrite(fs,fs->dirtylist[i]+1,fs->inodetable[fs->dirtylist[i]].data);
+                fs->inodedirty[fs->dirtylist[i]] = 0;
+        }
+        fs->ndirty = 0;
+        pthread_mutex_unlock(&fs->tablelock);
+}
+
+// set the bit indicating that block b is free; with a journal, the block
+// is only handed out again after the next checkpoint
+static void markfree(struct fs *fs, int b) {
+        pthread_mutex_lock(&fs->alloclock);
+        if (fs->journal) bitmap_set(fs->freeing,b);
+        else bitmap_set(fs->freeblock,b);
+        bitmap_set(fs->bitmapdirty,b/BITS_PER_BLOCK);
+        pthread_mutex_unlock(&fs->alloclock);
+}
+
+// set the bit indicating that block b is used; the caller holds alloclock
+static void markused(struct fs *fs, int b) {
+        bitmap_clear(fs->freeblock,b);
+        bitmap_set(fs->bitmapdirty,b/BITS_PER_BLOCK);
+}
+
+// check to see if block b is free; the caller holds alloclock
+static int isfree(struct fs *fs, int b) {
+        return bitmap_test(fs->freeblock,b);
+}
+
+// return number of free blocks that are not reserved; the caller holds alloclock
 // This also expects the superblock and inode blocks to be marked unavailable
-unsigned int nfreeblocks() {
-        unsigned int n=0;
-        for(int i=0;i<disk_nblocks(thedisk);i++)
-                if (isfree(i)) n++;
+static unsigned int nfreeblocks(struct fs *fs) {
+        return bitmap_count(fs->freeblock) - fs->nreserved;
+}
+
+// set aside n free blocks for the caller, or return 0 if there are not enough
+static int reserveblocks(struct fs *fs, unsigned int n) {
+        pthread_mutex_lock(&fs->alloclock);
+        int ok = n <= nfreeblocks(fs);
+        if (ok) fs->nreserved += n;
+        pthread_mutex_unlock(&fs->alloclock);
+        return ok;
+}
+
+// give back reserved blocks that were not used
+static void unreserveblocks(struct fs *fs, unsigned int n) {
+        pthread_mutex_lock(&fs->alloclock);
+        fs->nreserved -= n;
+        pthread_mutex_unlock(&fs->alloclock);
+}
+
+// set aside n free blocks for a write, taking them first from the *held blocks its
+// caller reserved earlier, if held is not NULL, and lowering *held by as many;
+// returns 0, with nothing taken, if there are not enough
+static int claimblocks(struct fs *fs, int n, int *held) {
+        int from = held != NULL ? MIN(*held,n) : 0;
+        if (!reserveblocks(fs,n - from)) return 0;
+        if (held != NULL) *held -= from;
+        return 1;
+}
+
+// take one block out of an earlier reservation; cannot fail
+static int allocblock(struct fs *fs) {
+        pthread_mutex_lock(&fs->alloclock);
+        int b = bitmap_find(fs->freeblock);
+        markused(fs,b);
+        fs->nreserved--;
+        pthread_mutex_unlock(&fs->alloclock);
+        return b;
+}
+
+// take n blocks out of an earlier reservation as contiguous runs, as long as the free
+// space allows, starting as near as possible after goal; blocks[] gets them in order.
+// A goal of 0 or less means the blocks start a new file, which is placed where the last
+// new file started plus NEWFILE_GAP, so that files written side by side do not interleave.
+// A file whose goal is already taken has run into a neighbour and is moved on the same way.
+static void allocblocks(struct fs *fs, int goal, int n, int *blocks) {
+        pthread_mutex_lock(&fs->alloclock);
+        int newfile = goal <= 0 || goal >= fs->super.nblocks || !isfree(fs,goal);
+        int done = 0;
+
+        if (newfile) goal = fs->newfilegoal;
+        while (done < n) {
+                int len;
+                int b = bitmap_find_run(fs->freeblock,goal,n - done,&len);
+                for(int i=0;i<len;i++) {
+                        markused(fs,b + i);
+                        blocks[done++] = b + i;
+                }
+                goal = b + len;
+        }
+        fs->nreserved -= n;
+
+        if (newfile && n > 0) fs->newfilegoal = (blocks[0] + NEWFILE_GAP) % fs->super.nblocks;
+        pthread_mutex_unlock(&fs->alloclock);
+}
+
+// log the inode blocks and bitmap blocks the running transaction changed; the caller holds
+// commitlock and the journal barrier, so no operation is half done. Blocks waiting in
+// freeing and freed are free in the logged bitmap, which is what a checkpoint makes true.
+static void logtables(struct fs *fs) {
+        pthread_mutex_lock(&fs->tablelock);
+        for(int i=0;i<fs->ndirty;i++) {
+                journal_write(fs->journal,fs->dirtylist[i]+1,fs->inodetable[fs->dirtylist[i]].data);
+                fs->inodedirty[fs->dirtylist[i]] = 0;
+        }
+        fs->ndirty = 0;
+        pthread_mutex_unlock(&fs->tablelock);
+
+        pthread_mutex_lock(&fs->alloclock);
+        if (bitmap_count(fs->bitmapdirty) > 0) {
+                size_t size = (size_t)fs->super.nbitmapblocks*BLOCK_SIZE;
+                uint64_t *image = aligned_alloc(BLOCK_SIZE,size);
+                uint64_t *pending = aligned_alloc(BLOCK_SIZE,size);
+                if (image == NULL || pending == NULL) {
+                        fprintf(stderr,"logtables: out of memory\n");
+                        abort();
+                }
+                memset(image,0,size);
+                memset(pending,0,size);
+                bitmap_store(fs->freeblock,image);
+                bitmap_store(fs->freeing,pending);
+                for(size_t w=0;w<size/8;w++) image[w] |= pending[w];
+                bitmap_store(fs->freed,pending);
+                for(size_t w=0;w<size/8;w++) image[w] |= pending[w];
+
+                for(int b=bitmap_find_next(fs->bitmapdirty,0);b>=0;b=bitmap_find_next(fs->bitmapdirty,b+1))
+                        journal_write(fs->journal,fs->super.bitmapstart + b,(unsigned char *)image + (size_t)b*BLOCK_SIZE);
+                bitmap_clearall(fs->bitmapdirty);
+                free(image);
+                free(pending);
+        }
+
+        // the frees of this transaction wait for the checkpoint after its commit
+        bitmap_or(fs->freed,fs->freeing);
+        bitmap_clearall(fs->freeing);
+        pthread_mutex_unlock(&fs->alloclock);
+}
+
+// write every committed block home and hand the blocks freed by those transactions
+// back to the allocator; the caller holds commitlock
+static int checkpointlocked(struct fs *fs) {
+        if (!journal_checkpoint(fs->journal)) return 0;
+        fs->ncheckpoints++;
+        pthread_mutex_lock(&fs->alloclock);
+        bitmap_or(fs->freeblock,fs->freed);
+        bitmap_clearall(fs->freed);
+        pthread_mutex_unlock(&fs->alloclock);
+        return 1;
+}
+
+// commit the running transaction; the caller must not be inside an operation
+static int commit(struct fs *fs) {
+        pthread_mutex_lock(&fs->commitlock);
+        journal_barrier(fs->journal);
+        logtables(fs);
+        int ok = journal_commit(fs->journal);
+        if (ok) fs->ncommits++;
+        pthread_mutex_unlock(&fs->commitlock);
+        return ok;
+}
+
+static int checkpoint(struct fs *fs) {
+        pthread_mutex_lock(&fs->commitlock);
+        int ok = checkpointlocked(fs);
+        pthread_mutex_unlock(&fs->commitlock);
+        return ok;
+}
+
+// inode table and bitmap blocks changed since the last commit, which it logs
+static int pendingtables(struct fs *fs) {
+        pthread_mutex_lock(&fs->tablelock);
+        int n = fs->ndirty;
+        pthread_mutex_unlock(&fs->tablelock);
+        pthread_mutex_lock(&fs->alloclock);
+        n += bitmap_count(fs->bitmapdirty);
+        pthread_mutex_unlock(&fs->alloclock);
+        return n;
+}
+
+// begin and end an operation that changes metadata; on a journaled filesystem its changes
+// commit together. Inode locks are taken before beginop and released after endop, so that
+// nothing inside an operation waits for one; a commit can then wait for the operations
+// in progress even when called by a thread holding inode locks.
+static void beginop(struct fs *fs) {
+        if (fs->journal) journal_start(fs->journal);
+}
+
+static void endop(struct fs *fs) {
+        if (fs->journal && journal_stop(fs->journal,pendingtables(fs))) commit(fs);
+}
+
+// whether blocks are waiting for a checkpoint to be free again
+static int freeing(struct fs *fs) {
+        if (fs->journal == NULL) return 0;
+        pthread_mutex_lock(&fs->alloclock);
+        int n = bitmap_count(fs->freeing) + bitmap_count(fs->freed);
+        pthread_mutex_unlock(&fs->alloclock);
+        return n > 0;
+}
+
+// the pointer to logical block l of a block-mapped inode, whose indirect block is in indirblock
+static uint32_t *blockpointer(struct fs_inode *inode, union fs_block *indirblock, int l) {
+        if (l < POINTERS_PER_INODE) return &inode->direct[l];
+        return &indirblock->pointers[l - POINTERS_PER_INODE];
+}
+
+// map blocks first..first+n-1 of a block-mapped inode for writing, allocating every
+// data block and the indirect block it lacks; fresh[i] is set for each new block.
+// Everything is reserved up front, out of *held first, and the indirect block is read
+// and written once. New data blocks are allocated as contiguous runs following the file's
+// previous block. Returns n, or 0 if there are not enough free blocks.
+static int pointerwrite(struct fs *fs, struct fs_inode *inode, int first, int n, int *blocks, unsigned char *fresh, int *held) {
+        int last = first + n - 1;
+        union fs_block indirblock;
+        int indirect_dirty = 0;
+
+        if (last >= POINTERS_PER_INODE) {
+                if (inode->indirect == 0) memset(indirblock.data,0,BLOCK_SIZE);
+                else bread(fs,inode->indirect,indirblock.data);
+        }
+
+        // find every data block this write has to allocate, and the block
+        // just after the one before the first of them, where they should go
+        int needed = 0;
+        int goal = -1;
+        for(int i=0;i<n;i++) {
+                if (*blockpointer(inode,&indirblock,first + i) != 0) continue;
+                if (needed == 0 && first + i > 0 && *blockpointer(inode,&indirblock,first + i - 1) != 0)
+                        goal = *blockpointer(inode,&indirblock,first + i - 1) + 1;
+                fresh[i] = 1;
+                needed++;
+        }
+        int newindirect = last >= POINTERS_PER_INODE && inode->indirect == 0;
+
+        if (!claimblocks(fs,needed + newindirect,held)) {
+                printf("Not enough free blocks\n");
+                return 0;
+        }
+
+        int *newblocks = malloc(MAX(needed,1)*sizeof(int));
+        if (newblocks == NULL) {
+                perror("malloc failed");
+                unreserveblocks(fs,needed + newindirect);
+                for(int i=0;i<n;i++) fresh[i] = 0;
+                return 0;
+        }
+        allocblocks(fs,goal,needed,newblocks);
+
+        if (newindirect) {
+                inode->indirect = allocblock(fs);
+                indirect_dirty = 1;
+        }
+
+        int k = 0;
+        for(int i=0;i<n;i++) {
+                uint32_t *pointer = blockpointer(inode,&indirblock,first + i);
+                if (fresh[i]) {
+                        *pointer = newblocks[k++];
+                        if (first + i >= POINTERS_PER_INODE) indirect_dirty = 1;
+                }
+                blocks[i] = *pointer;
+        }
+        free(newblocks);
+
+        if (indirect_dirty) bwrite(fs,inode->indirect,indirblock.data);
+
         return n;
 }
 
-int fs_format()
+// fill plain[] with the contents of the clusters whose pointers are pointers[0..n-1],
+// CLUSTER_SIZE bytes each, the first pointer starting a cluster. Every block they take
+// is read with one vectored request; a pointer of 0 reads as zeros.
+// Returns the number of blocks that came from the disk, or -1 on failure.
+static int loadclusters(struct fs *fs, const int *pointers, int n, unsigned char *plain) {
+        int nclusters = (n + CLUSTER_BLOCKS - 1) / CLUSTER_BLOCKS;
+        int *blocks = malloc(n*sizeof(int));
+        unsigned char **bufs = malloc(n*sizeof(unsigned char *));
+        unsigned char *packed = aligned_alloc(BLOCK_SIZE,(size_t)nclusters*CLUSTER_SIZE);
+        if (blocks == NULL || bufs == NULL || packed == NULL) {
+                perror("malloc failed");
+                free(blocks);
+                free(bufs);
+                free(packed);
+                return -1;
+        }
+
+        // the blocks of a compressed cluster are read aside, the others straight into place
+        int nread = 0;
+        memset(plain,0,(size_t)nclusters*CLUSTER_SIZE);
+        for(int i=0;i<n;i++) {
+                if (POINTER_BLOCK(pointers[i]) == 0) continue;
+                blocks[nread] = POINTER_BLOCK(pointers[i]);
+                bufs[nread++] = (pointers[i] & POINTER_COMPRESSED ? packed : plain) + (size_t)i*BLOCK_SIZE;
+        }
+        int missed = cache_readv(fs->cache,blocks,bufs,nread);
+
+        for(int c=0;c<nclusters && missed>=0;c++) {
+                int p = pointers[c*CLUSTER_BLOCKS];
+                if (!(p & POINTER_COMPRESSED)) continue;
+                if (lz_decompress(packed + (size_t)c*CLUSTER_SIZE,POINTER_LENGTH(p)*BLOCK_SIZE,
+                                  plain + (size_t)c*CLUSTER_SIZE,CLUSTER_SIZE) < 0) {
+                        printf("Compressed data is damaged\n");
+                        missed = -1;
+                }
+        }
+
+        free(blocks);
+        free(bufs);
+        free(packed);
+        return missed;
+}
+
+// writeblocks for a compressed file. Every cluster the write touches is rebuilt, with its
+// old contents where the write does not cover them, compressed, and written in one vectored
+// request. A cluster keeps as many of its blocks as it still needs, frees the rest, and
+// allocates any more it needs after the block before it. Handles of the file forget
+// the clusters that were rewritten. Returns the bytes written, or 0 on failure.
+static int clusterwrite(struct fs *fs, int inumber, struct fs_inode *inode, const unsigned char *data, int length, int offset, int *held) {
+        int size = MAX((int)inode->size,offset + length);
+        int nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int first = offset / CLUSTER_SIZE * CLUSTER_BLOCKS;
+        int end = MIN(((offset + length - 1) / CLUSTER_SIZE + 1) * CLUSTER_BLOCKS,nblocks);
+        int n = end - first;
+        int nclusters = (n + CLUSTER_BLOCKS - 1) / CLUSTER_BLOCKS;
+        union fs_block indirblock;
+        int indirect_dirty = 0;
+
+        // old[], edges[], blocks[] and newblocks[] take n each, packedlen[] one per cluster;
+        // the clusters are built in plain and compressed into packed
+        int *ints = malloc((4*n + nclusters)*sizeof(int));
+        unsigned char **bufs = malloc(n*sizeof(unsigned char *));
+        unsigned char *plain = aligned_alloc(BLOCK_SIZE,(size_t)2*nclusters*CLUSTER_SIZE);
+        if (ints == NULL || bufs == NULL || plain == NULL) {
+                perror("malloc failed");
+                free(ints);
+                free(bufs);
+                free(plain);
+                return 0;
+        }
+        int *old = ints;
+        int *edges = ints + n;
+        int *blocks = ints + 2*n;
+        int *newblocks = ints + 3*n;
+        int *packedlen = ints + 4*n;
+        unsigned char *packed = plain + (size_t)nclusters*CLUSTER_SIZE;
+
+        if (end > POINTERS_PER_INODE) {
+                if (inode->indirect == 0) memset(indirblock.data,0,BLOCK_SIZE);
+                else bread(fs,inode->indirect,indirblock.data);
+        }
+        for(int i=0;i<n;i++) old[i] = *blockpointer(inode,&indirblock,first + i);
+
+        // only clusters the write does not cover up to the old end of the file are read
+        for(int i=0;i<n;i++) {
+                int start = (first + i / CLUSTER_BLOCKS * CLUSTER_BLOCKS) * BLOCK_SIZE;
+                int covered = offset <= start && offset + length >= MIN(start + CLUSTER_SIZE,(int)inode->size);
+                edges[i] = covered ? 0 : old[i];
+        }
+        if (loadclusters(fs,edges,n,plain) < 0) {
+                free(ints);
+                free(bufs);
+                free(plain);
+                return 0;
+        }
+        memcpy(plain + (offset - first*BLOCK_SIZE),data,length);
+
+        // compress each cluster, keeping it only if it saves a block,
+        // and count the blocks it needs beyond the ones it has
+        int needed = 0;
+        for(int c=0;c<nclusters;c++) {
+                int start = first + c*CLUSTER_BLOCKS;
+                int nb = MIN(CLUSTER_BLOCKS,nblocks - start);
+                unsigned char *out = packed + (size_t)c*CLUSTER_SIZE;
+                int len = nb > 1 ? lz_compress(plain + (size_t)c*CLUSTER_SIZE,MIN(CLUSTER_SIZE,size - start*BLOCK_SIZE),out,(nb - 1)*BLOCK_SIZE) : 0;
+                int take = len > 0 ? (len + BLOCK_SIZE - 1) / BLOCK_SIZE : nb;
+                if (len > 0) memset(out + len,0,take*BLOCK_SIZE - len);
+                packedlen[c] = len;
+
+                int had = 0;
+                while (had < nb && old[c*CLUSTER_BLOCKS + had] != 0) had++;
+                needed += MAX(0,take - had);
+        }
+        int newindirect = end > POINTERS_PER_INODE && inode->indirect == 0;
+
+        if (!claimblocks(fs,needed + newindirect,held)) {
+                printf("Not enough free blocks\n");
+                free(ints);
+                free(bufs);
+                free(plain);
+                return 0;
+        }
+
+        // new blocks follow the last block the file has in these clusters or the one before
+        int goal = -1;
+        for(int l=end-1;l>=0 && l>=first-CLUSTER_BLOCKS && goal<0;l--) {
+                uint32_t b = POINTER_BLOCK(l >= first ? old[l - first] : *blockpointer(inode,&indirblock,l));
+                if (b != 0) goal = b + 1;
+        }
+        allocblocks(fs,goal,needed,newblocks);
+
+        if (newindirect) {
+                inode->indirect = allocblock(fs);
+                indirect_dirty = 1;
+        }
+
+        int k = 0;
+        int nwrite = 0;
+        int ncompressed = 0;
+        int saved = 0;
+        for(int c=0;c<nclusters;c++) {
+                int start = first + c*CLUSTER_BLOCKS;
+                int nb = MIN(CLUSTER_BLOCKS,nblocks - start);
+                int take = packedlen[c] > 0 ? (packedlen[c] + BLOCK_SIZE - 1) / BLOCK_SIZE : nb;
+                uint32_t flags = packedlen[c] > 0 ? POINTER_COMPRESSED | (uint32_t)(take - 1) << 28 : 0;
+                unsigned char *src = (packedlen[c] > 0 ? packed : plain) + (size_t)c*CLUSTER_SIZE;
+
+                for(int j=0;j<nb;j++) {
+                        int had = POINTER_BLOCK(old[c*CLUSTER_BLOCKS + j]);
+                        uint32_t p = 0;
+                        if (j < take) {
+                                int b = had != 0 ? had : newblocks[k++];
+                                p = b | flags;
+                                blocks[nwrite] = b;
+                                bufs[nwrite++] = src + (size_t)j*BLOCK_SIZE;
+                        } else if (had != 0) {
+                                markfree(fs,had);
+                        }
+                        uint32_t *pointer = blockpointer(inode,&indirblock,start + j);
+                        if (*pointer != p && start + j >= POINTERS_PER_INODE) indirect_dirty = 1;
+                        *pointer = p;
+                }
+
+                if (packedlen[c] > 0) {
+                        ncompressed++;
+                        saved += nb - take;
+                }
+        }
+
+        cache_writev(fs->cache,blocks,(const unsigned char **)bufs,nwrite);
+        if (indirect_dirty) bwrite(fs,inode->indirect,indirblock.data);
+
+        pthread_mutex_lock(&fs->lock);
+        for(int i=0;i<OPEN_FILES;i++) {
+                if (fs->openfiles[i].inumber != inumber) continue;
+                fs->openfiles[i].nmapped = MIN(fs->openfiles[i].nmapped,first);
+                fs->openfiles[i].cached = 0;
+        }
+        fs->nclusters += ncompressed;
+        fs->nwhole += nclusters - ncompressed;
+        fs->nsaved += saved;
+        pthread_mutex_unlock(&fs->lock);
+
+        free(ints);
+        free(bufs);
+        free(plain);
+
+        inode->size = size;
+        dirtyinode(fs,inumber);
+        syncinodes(fs);
+
+        return length;
+}
+
+// read length bytes at offset of a compressed file, all of them inside its blocks,
+// a whole cluster at a time. A read through handle f that stays inside one cluster
+// keeps it decompressed in the handle, so the next read there finds it.
+// Returns 0 on failure
+static int clusterread(struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, unsigned char *data, int length, int offset) {
+        int first = offset / CLUSTER_SIZE * CLUSTER_BLOCKS;
+        int end = MIN(((offset + length - 1) / CLUSTER_SIZE + 1) * CLUSTER_BLOCKS,((int)inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        int n = end - first;
+        int keep = f != NULL && n <= CLUSTER_BLOCKS;
+        int cluster = first / CLUSTER_BLOCKS;
+
+        if (keep && f->cached == cluster + 1) {
+                memcpy(data,f->plain + offset % CLUSTER_SIZE,length);
+                return 1;
+        }
+        if (keep && f->plain == NULL) f->plain = aligned_alloc(BLOCK_SIZE,CLUSTER_SIZE);
+
+        int *pointers = malloc(n*sizeof(int));
+        unsigned char *plain = keep ? f->plain : aligned_alloc(BLOCK_SIZE,(size_t)(n + CLUSTER_BLOCKS - 1) / CLUSTER_BLOCKS * CLUSTER_SIZE);
+        if (pointers == NULL || plain == NULL) {
+                perror("malloc failed");
+                free(pointers);
+                if (!keep) free(plain);
+                return 0;
+        }
+
+        filemap(fs,f,inode,first,n,pointers);
+        int nread = 0;
+        for(int i=0;i<n;i++)
+                if (POINTER_BLOCK(pointers[i]) != 0) nread++;
+        int missed = loadclusters(fs,pointers,n,plain);
+        if (missed >= 0) memcpy(data,plain + (offset - first*BLOCK_SIZE),length);
+        if (keep) f->cached = missed >= 0 ? cluster + 1 : 0;
+
+        // a read continuing a stream counts its blocks as readahead hits or misses
+        struct readahead *ra = &fs->rastate[inumber % RA_SLOTS];
+        pthread_mutex_lock(&fs->lock);
+        if (missed >= 0 && ra->inumber == inumber && ra->next == offset && offset > 0) {
+                fs->ra_hits += nread - missed;
+                fs->ra_misses += missed;
+        }
+        pthread_mutex_unlock(&fs->lock);
+
+        free(pointers);
+        if (!keep) free(plain);
+        return missed >= 0;
+}
+
+// number of inline extents in use
+static int inlineextents(struct fs_inode *inode) {
+        int count = 0;
+        while (count < EXTENTS_PER_INODE && inode->extent[count].length != 0) count++;
+        return count;
+}
+
+// append the n blocks in blocks[] to the end of the extent map of inode, folding runs
+// of consecutive blocks into one extent. The map moves from the inode to a root block
+// when the inline extents are full, and the root becomes an index of leaves when it is;
+// tree blocks are taken from the *spare blocks reserved for them.
+// Returns the number of blocks appended, less than n only if the tree is full.
+static int extentappend(struct fs *fs, struct fs_inode *inode, const int *blocks, int n, int *spare) {
+        union fs_block root, leaf;
+        int rootblock = 0;
+        int leafblock = 0;
+        int added = 0;
+
+        if (inode->isvalid & INODE_EXTENT_TREE) {
+                rootblock = inode->extent[0].start;
+                bread(fs,rootblock,root.data);
+                if (root.extents.depth == 1) {
+                        leafblock = root.extents.entry[root.extents.count - 1].start;
+                        bread(fs,leafblock,leaf.data);
+                }
+        }
+
+        while (added < n) {
+                // the next run of consecutive blocks
+                int start = blocks[added];
+                int len = 1;
+                while (added + len < n && blocks[added + len] == start + len) len++;
+
+                // find where the last extent lives and how many more fit there
+                struct fs_extent *ext;
+                uint32_t *count = NULL;
+                uint32_t ninline;
+                int cap = EXTENTS_PER_BLOCK;
+                if (rootblock == 0) {
+                        ext = inode->extent;
+                        ninline = inlineextents(inode);
+                        count = &ninline;
+                        cap = EXTENTS_PER_INODE;
+                } else if (leafblock == 0) {
+                        ext = root.extents.entry;
+                        count = &root.extents.count;
+                } else {
+                        ext = leaf.extents.entry;
+                        count = &leaf.extents.count;
+                }
+
+                if (*count > 0 && ext[*count - 1].start + ext[*count - 1].length == start) {
+                        ext[*count - 1].length += len;
+                } else if (*count < cap) {
+                        ext[*count].start = start;
+                        ext[*count].length = len;
+                        (*count)++;
+                } else if (*spare == 0) {
+                        break;
+                } else if (rootblock == 0) {
+                        // inline extents are full: move them to a root block
+                        rootblock = allocblock(fs);
+                        (*spare)--;
+                        memset(root.data,0,BLOCK_SIZE);
+                        root.extents.count = EXTENTS_PER_INODE;
+                        memcpy(root.extents.entry,inode->extent,sizeof(inode->extent));
+                        memset(inode->extent,0,sizeof(inode->extent));
+                        inode->extent[0].start = rootblock;
+                        inode->isvalid |= INODE_EXTENT_TREE;
+                        continue;
+                } else if (leafblock == 0) {
+                        // the root is full of extents: they become its first leaf
+                        uint32_t total = 0;
+                        for(int k=0;k<root.extents.count;k++) total += root.extents.entry[k].length;
+                        leaf = root;
+                        leafblock = allocblock(fs);
+                        (*spare)--;
+                        memset(root.data,0,BLOCK_SIZE);
+                        root.extents.depth = 1;
+                        root.extents.count = 1;
+                        root.extents.entry[0].start = leafblock;
+                        root.extents.entry[0].length = total;
+                        continue;
+                } else if (root.extents.count < EXTENTS_PER_BLOCK) {
+                        // the last leaf is full: start another
+                        bwrite(fs,leafblock,leaf.data);
+                        leafblock = allocblock(fs);
+                        (*spare)--;
+                        memset(leaf.data,0,BLOCK_SIZE);
+                        root.extents.entry[root.extents.count].start = leafblock;
+                        root.extents.entry[root.extents.count].length = 0;
+                        root.extents.count++;
+                        continue;
+                } else {
+                        break;
+                }
+
+                if (leafblock != 0) root.extents.entry[root.extents.count - 1].length += len;
+                added += len;
+        }
+
+        if (rootblock != 0) bwrite(fs,rootblock,root.data);
+        if (leafblock != 0) bwrite(fs,leafblock,leaf.data);
+
+        return added;
+}
+
+// map blocks first..first+n-1 of an extent-mapped inode for writing. Files have no holes,
+// so the blocks up to its size are mapped already and the rest are allocated and appended;
+// fresh[i] is set for each new block; the blocks are reserved out of *held first.
+// Returns how many blocks were mapped.
+static int extentwrite(struct fs *fs, struct fs_inode *inode, int first, int n, int *blocks, unsigned char *fresh, int *held) {
+        int oldblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int nold = MIN(n, oldblocks - first);
+        int nnew = n - nold;
+
+        // enough tree blocks for every new block to start an extent
+        int spare = nnew / EXTENTS_PER_BLOCK + 4;
+        if (nnew == 0) spare = 0;
+
+        if (!claimblocks(fs,nnew + spare,held)) {
+                printf("Not enough free blocks\n");
+                return 0;
+        }
+
+        // the new blocks go right after the file's last block if they can
+        int goal = -1;
+        mapblocks(fs,inode,first,nold,blocks);
+        if (nnew > 0 && nold > 0) {
+                goal = blocks[nold - 1] + 1;
+        } else if (nnew > 0 && oldblocks > 0) {
+                mapblocks(fs,inode,oldblocks - 1,1,&goal);
+                goal++;
+        }
+        allocblocks(fs,goal,nnew,blocks + nold);
+        for(int i=nold;i<n;i++) fresh[i] = 1;
+
+        int added = nnew > 0 ? extentappend(fs,inode,blocks + nold,nnew,&spare) : 0;
+        if (added < nnew) {
+                printf("Extent tree full\n");
+                for(int i=nold+added;i<n;i++) markfree(fs,blocks[i]);
+        }
+        unreserveblocks(fs,spare);
+
+        return nold + added;
+}
+
+// print extents ext[0..count-1] as ranges of blocks
+static void printruns(const struct fs_extent *ext, int count) {
+        for(int k=0;k<count;k++) {
+                if (ext[k].length == 1) printf(" %d",ext[k].start);
+                else if (ext[k].length > 1) printf(" %d-%d",ext[k].start,ext[k].start + ext[k].length - 1);
+        }
+}
+
+// print the extents of an inode for fs_debug, and the blocks of its tree if it has one
+static void printextents(struct fs *fs, struct fs_inode *inode) {
+        union fs_block root, leaf;
+
+        if (!(inode->isvalid & INODE_EXTENT_TREE)) {
+                printf("    extents:");
+                printruns(inode->extent,EXTENTS_PER_INODE);
+                printf("\n");
+                return;
+        }
+
+        bread(fs,inode->extent[0].start,root.data);
+        printf("    extent tree (in block %d",inode->extent[0].start);
+        if (root.extents.depth == 0) {
+                printf("):");
+                printruns(root.extents.entry,root.extents.count);
+        } else {
+                printf(", leaves in blocks");
+                for(int k=0;k<root.extents.count;k++) printf(" %d",root.extents.entry[k].start);
+                printf("):");
+                for(int k=0;k<root.extents.count;k++) {
+                        bread(fs,root.extents.entry[k].start,leaf.data);
+                        printruns(leaf.extents.entry,leaf.extents.count);
+                }
+        }
+        printf("\n");
+}
+
+// write the resident superblock to block 0 with the clean flag set or cleared
+static void writesuper(struct fs *fs, int clean) {
+        union fs_block block;
+        if (clean) fs->super.flags |= FS_CLEAN;
+        else fs->super.flags &= ~FS_CLEAN;
+        memset(block.data,0,BLOCK_SIZE);
+        block.super = fs->super;
+        disk_write(fs->disk,0,block.data);
+}
+
+// move the free block bitmap between memory and its blocks after the inode table,
+// in one transfer; returns 0 if no buffer could be allocated
+static int bitmapio(struct fs *fs, int write) {
+        size_t size = (size_t)fs->super.nbitmapblocks*BLOCK_SIZE;
+        unsigned char *buffer = aligned_alloc(BLOCK_SIZE,size);
+        if (buffer == NULL) return 0;
+        if (write) {
+                memset(buffer,0,size);
+                bitmap_store(fs->freeblock,(uint64_t *)buffer);
+                disk_write_range(fs->disk,fs->super.bitmapstart,fs->super.nbitmapblocks,buffer);
+        } else {
+                disk_read_range(fs->disk,fs->super.bitmapstart,fs->super.nbitmapblocks,buffer);
+                bitmap_load(fs->freeblock,(const uint64_t *)buffer);
+        }
+        free(buffer);
+        return 1;
+}
+
+// mark the n indirect blocks in indirect[], already read into bufs[], and everything they point to
+static void scanindirect(struct fs *fs, struct bitmap *used, int *indirect, unsigned char **bufs, int n) {
+        disk_readv(fs->disk,indirect,bufs,n);
+        for(int i=0;i<n;i++) {
+                uint32_t *pointers = (uint32_t *)bufs[i];
+                for(int k=0;k<POINTERS_PER_BLOCK;k++) {
+                        uint32_t b = POINTER_BLOCK(pointers[k]);
+                        if (b == 0 || b >= fs->super.nblocks) continue;
+                        bitmap_set(used,b);
+                }
+        }
+}
+
+// mark the blocks of extents ext[0..count-1] in used
+static void markextents(struct fs *fs, struct bitmap *used, const struct fs_extent *ext, int count) {
+        for(int k=0;k<count && k<EXTENTS_PER_BLOCK;k++) {
+                for(uint32_t b=ext[k].start;b<ext[k].start+ext[k].length && b<fs->super.nblocks;b++)
+                        bitmap_set(used,b);
+        }
+}
+
+// mark the blocks of an extent-mapped inode in used, reading its tree, if any, straight from the disk
+static void scanextents(struct fs *fs, struct bitmap *used, struct fs_inode *inode) {
+        union fs_block root, leaf;
+
+        if (!(inode->isvalid & INODE_EXTENT_TREE)) {
+                markextents(fs,used,inode->extent,EXTENTS_PER_INODE);
+                return;
+        }
+
+        if (inode->extent[0].start == 0 || inode->extent[0].start >= fs->super.nblocks) return;
+        bitmap_set(used,inode->extent[0].start);
+        disk_read(fs->disk,inode->extent[0].start,root.data);
+        if (root.extents.depth == 0) {
+                markextents(fs,used,root.extents.entry,root.extents.count);
+                return;
+        }
+
+        for(int k=0;k<root.extents.count && k<EXTENTS_PER_BLOCK;k++) {
+                uint32_t b = root.extents.entry[k].start;
+                if (b == 0 || b >= fs->super.nblocks) continue;
+                bitmap_set(used,b);
+                disk_read(fs->disk,b,leaf.data);
+                markextents(fs,used,leaf.extents.entry,leaf.extents.count);
+        }
+}
+
+// worker of the recovery scan: walk its share of the resident inode table, batching
+// the indirect blocks into vectored reads that bypass the cache
+static void *scanworker(void *arg) {
+        struct scanjob *job = arg;
+        struct fs *fs = job->fs;
+        int indirect[SCAN_BATCH];
+        unsigned char *bufs[SCAN_BATCH];
+        unsigned char *pool = aligned_alloc(BLOCK_SIZE,SCAN_BATCH*BLOCK_SIZE);
+        int n = 0;
+
+        job->used = bitmap_create(fs->super.nblocks);
+        job->ok = pool != NULL && job->used != NULL;
+        if (!job->ok) {
+                free(pool);
+                return NULL;
+        }
+        for(int i=0;i<SCAN_BATCH;i++) bufs[i] = pool + i*BLOCK_SIZE;
+
+        for(int i=job->start;i<fs->super.ninodeblocks;i+=job->stride) {
+                for(int j=0;j<fs->inodesperblock;j++) {
+                        struct fs_inode *inode = getinode(fs,i*fs->inodesperblock + j);
+                        if (inode->isvalid == 0 || (inode->isvalid & INODE_INLINE)) continue;
+                        if (EXTENTS(fs)) {
+                                scanextents(fs,job->used,inode);
+                                continue;
+                        }
+                        for(int k=0;k<POINTERS_PER_INODE;k++) {
+                                uint32_t b = POINTER_BLOCK(inode->direct[k]);
+                                if (b == 0 || b >= fs->super.nblocks) continue;
+                                bitmap_set(job->used,b);
+                        }
+                        if (inode->indirect == 0 || inode->indirect >= fs->super.nblocks) continue;
+                        if (bitmap_test(job->used,inode->indirect)) continue;
+                        bitmap_set(job->used,inode->indirect);
+                        indirect[n++] = inode->indirect;
+                        if (n == SCAN_BATCH) {
+                                scanindirect(fs,job->used,indirect,bufs,n);
+                                n = 0;
+                        }
+                }
+        }
+        scanindirect(fs,job->used,indirect,bufs,n);
+
+        free(pool);
+        return NULL;
+}
+
+// rebuild the free block bitmap from the inode table on up to SCAN_THREADS threads;
+// their bitmaps of used blocks are OR-merged and inverted. Returns 0 on failure.
+static int scanblocks(struct fs *fs) {
+        struct scanjob jobs[SCAN_THREADS];
+        pthread_t threads[SCAN_THREADS];
+        int started[SCAN_THREADS];
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        int nthreads = MIN(MIN(ncpu > 0 ? ncpu : 1, SCAN_THREADS), fs->super.ninodeblocks);
+        int ok = 1;
+
+        for(int t=0;t<nthreads;t++) {
+                jobs[t].fs = fs;
+                jobs[t].start = t;
+                jobs[t].stride = nthreads;
+                started[t] = t > 0 && pthread_create(&threads[t],NULL,scanworker,&jobs[t]) == 0;
+        }
+
+        // the calling thread does the first share, and any a thread could not be started for
+        for(int t=0;t<nthreads;t++)
+                if (!started[t]) scanworker(&jobs[t]);
+        for(int t=0;t<nthreads;t++)
+                if (started[t]) pthread_join(threads[t],NULL);
+
+        struct bitmap *used = jobs[0].used;
+        for(int t=0;t<nthreads;t++) {
+                ok = ok && jobs[t].ok;
+                if (t > 0 && ok) bitmap_or(used,jobs[t].used);
+                if (t > 0) bitmap_destroy(jobs[t].used);
+        }
+        if (!ok) {
+                bitmap_destroy(used);
+                return 0;
+        }
+
+        // super block, inode blocks, bitmap blocks and journal blocks are always in use
+        bitmap_set(used,0);
+        for(int i=0;i<fs->super.ninodeblocks;i++) bitmap_set(used,i+1);
+        for(int i=0;i<fs->super.nbitmapblocks;i++) bitmap_set(used,fs->super.bitmapstart+i);
+        if (fs->super.flags & FS_JOURNAL)
+                for(int i=0;i<fs->super.njournalblocks;i++) bitmap_set(used,fs->super.journalstart+i);
+
+        bitmap_invert(used);
+        bitmap_destroy(fs->freeblock);
+        fs->freeblock = used;
+        return 1;
+}
+
+// the delayed-allocation buffer of inode inumber, or NULL if it has none
+static struct delayed *finddelayed(struct fs *fs, int inumber) {
+        struct delayed *d = NULL;
+        pthread_mutex_lock(&fs->lock);
+        for(int i=0;i<DELAYED_FILES && d == NULL;i++) {
+                if (fs->delayedfiles[i].inumber == inumber) d = &fs->delayedfiles[i];
+        }
+        pthread_mutex_unlock(&fs->lock);
+        return d;
+}
+
+// take a free delayed-allocation buffer for inode inumber, whose allocated blocks end
+// at byte base, or return NULL if every buffer is taken
+static struct delayed *claimdelayed(struct fs *fs, int inumber, int base, int size) {
+        struct delayed *d = NULL;
+        pthread_mutex_lock(&fs->lock);
+        for(int i=0;i<DELAYED_FILES && d == NULL;i++) {
+                if (fs->delayedfiles[i].inumber == 0) d = &fs->delayedfiles[i];
+        }
+        if (d != NULL) {
+                d->inumber = inumber;
+                d->base = base;
+                d->size = size;
+        }
+        pthread_mutex_unlock(&fs->lock);
+        return d;
+}
+
+// take n more blocks of delayed buffer space, or give back -n of them;
+// returns 0 if there is not enough left
+static int delayedspace(struct fs *fs, int n) {
+        pthread_mutex_lock(&fs->lock);
+        int ok = n <= 0 || fs->ndelayedblocks + n <= DELAYED_BLOCKS;
+        if (ok) fs->ndelayedblocks += n;
+        pthread_mutex_unlock(&fs->lock);
+        return ok;
+}
+
+// size of inode inumber, counting data that has no blocks yet
+static int filesize(struct fs *fs, int inumber, struct fs_inode *inode) {
+        struct delayed *d = finddelayed(fs,inumber);
+        return d != NULL ? d->size : inode->size;
+}
+
+// free blocks to set aside for n delayed blocks and the metadata they may need
+static int delayedreserve(struct fs *fs, int n) {
+        if (EXTENTS(fs)) return n + n / EXTENTS_PER_BLOCK + 4;
+        return n + 1;
+}
+
+// forget a delayed buffer without writing it, giving back its reservation
+static void dropdelayed(struct fs *fs, struct delayed *d) {
+        unreserveblocks(fs,d->reserved);
+        delayedspace(fs,-d->nblocks);
+        free(d->data);
+        pthread_mutex_lock(&fs->lock);
+        memset(d,0,sizeof(*d));
+        pthread_mutex_unlock(&fs->lock);
+}
+
+// free every block mapped by extents ext[0..count-1]
+static void freeextents(struct fs *fs, const struct fs_extent *ext, int count) {
+        for(int k=0;k<count;k++) {
+                for(uint32_t b=ext[k].start;b<ext[k].start+ext[k].length;b++) markfree(fs,b);
+        }
+}
+
+// free every block of inode inumber and mark it unused; meta holds the contents of its
+// indirect block or extent tree root, if it has one. Freed metadata blocks are not
+// rewritten, since nothing reads a block that is not in use.
+static void releaseinode(struct fs *fs, int inumber, const union fs_block *meta) {
+        struct fs_inode *inode = getinode(fs,inumber);
+
+        if (EXTENTS(fs)) {
+                if (meta == NULL) {
+                        freeextents(fs,inode->extent,EXTENTS_PER_INODE);
+                } else if (meta->extents.depth == 0) {
+                        freeextents(fs,meta->extents.entry,meta->extents.count);
+                        markfree(fs,inode->extent[0].start);
+                } else {
+                        union fs_block leaf;
+                        for(int k=0;k<meta->extents.count;k++) {
+                                bread(fs,meta->extents.entry[k].start,leaf.data);
+                                freeextents(fs,leaf.extents.entry,leaf.extents.count);
+                                markfree(fs,meta->extents.entry[k].start);
+                        }
+                        markfree(fs,inode->extent[0].start);
+                }
+                memset(inode->extent,0,sizeof(inode->extent));
+        } else {
+                for(int i=0;i<POINTERS_PER_INODE;i++) {
+                        if (inode->direct[i] != 0) markfree(fs,POINTER_BLOCK(inode->direct[i]));
+                        inode->direct[i] = 0;
+                }
+
+                if (inode->indirect != 0) {
+                        for(int i=0;i<POINTERS_PER_BLOCK;i++) {
+                                if (meta->pointers[i] != 0) markfree(fs,POINTER_BLOCK(meta->pointers[i]));
+                        }
+                        markfree(fs,inode->indirect);
+                        inode->indirect = 0;
+                }
+        }
+
+        // data that never got blocks is simply forgotten
+        struct delayed *d = finddelayed(fs,inumber);
+        if (d != NULL) dropdelayed(fs,d);
+
+        // handles still open on it can only be closed, and its read stream is forgotten
+        pthread_mutex_lock(&fs->lock);
+        for(int i=0;i<OPEN_FILES;i++) {
+                if (fs->openfiles[i].inumber != inumber) continue;
+                free(fs->openfiles[i].map);
+                free(fs->openfiles[i].plain);
+                fs->openfiles[i].map = NULL;
+                fs->openfiles[i].plain = NULL;
+                fs->openfiles[i].inumber = fs->openfiles[i].nmapped = fs->openfiles[i].capacity = 0;
+                fs->openfiles[i].cached = 0;
+        }
+        if (fs->rastate[inumber % RA_SLOTS].inumber == inumber)
+                fs->rastate[inumber % RA_SLOTS].inumber = 0;
+        pthread_mutex_unlock(&fs->lock);
+
+        inode->isvalid = 0;
+        inode->size = 0;
+        inode->ctime = 0;
+        dirtyinode(fs,inumber);
+
+        // the inode can be handed out again; whoever takes it waits for the caller's inode lock
+        pthread_mutex_lock(&fs->alloclock);
+        bitmap_set(fs->freeinode,inumber);
+        if (inumber < fs->inodehint) fs->inodehint = inumber;
+        pthread_mutex_unlock(&fs->alloclock);
+}
+
+// drop the journal, the cache and every resident table built by fs_mount
+static void fs_release(struct fs *fs) {
+        journal_close(fs->journal);
+        fs->journal = NULL;
+        if (fs->cache) cache_destroy(fs->cache);
+        fs->cache = NULL;
+        if (!fs->tablemapped) free(fs->inodetable);
+        fs->inodetable = NULL;
+        fs->diskmapped = 0;
+        fs->tablemapped = 0;
+        free(fs->inodedirty);
+        fs->inodedirty = NULL;
+        free(fs->dirtylist);
+        fs->dirtylist = NULL;
+        fs->ndirty = 0;
+        bitmap_destroy(fs->freeblock);
+        fs->freeblock = NULL;
+        bitmap_destroy(fs->freeinode);
+        fs->freeinode = NULL;
+        bitmap_destroy(fs->freeing);
+        fs->freeing = NULL;
+        bitmap_destroy(fs->freed);
+        fs->freed = NULL;
+        bitmap_destroy(fs->bitmapdirty);
+        fs->bitmapdirty = NULL;
+        memset(fs->rastate,0,sizeof(fs->rastate));
+        for(int i=0;i<DELAYED_FILES;i++) free(fs->delayedfiles[i].data);
+        memset(fs->delayedfiles,0,sizeof(fs->delayedfiles));
+        fs->ndelayedblocks = 0;
+        for(int i=0;i<OPEN_FILES;i++) {
+                free(fs->openfiles[i].map);
+                free(fs->openfiles[i].plain);
+        }
+        memset(fs->openfiles,0,sizeof(fs->openfiles));
+}
+
+static int readfile( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, unsigned char *data, int length, int offset );
+static int writefile( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, const unsigned char *data, int length, int offset );
+static int writeblocks( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, const unsigned char *data, int length, int offset, int *held );
+static int journaledwrite( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, const unsigned char *data, int length, int offset );
+
+// choose blocks for a delayed buffer and write it; the whole tail of the file
+// is known by now, so it is allocated in as few runs as the free space allows.
+// The blocks come out of the buffer's reservation, so no other write can take them first.
+// Returns 0 if only part of it could be written; the rest stays in the buffer,
+// with what is left of the reservation. The caller holds the file's inode lock for writing.
+static int flushdelayed(struct fs *fs, struct delayed *d) {
+        int length = d->size - d->base;
+        int done = length > 0 ? writeblocks(fs,d->inumber,getinode(fs,d->inumber),NULL,d->data,length,d->base,&d->reserved) : 0;
+        if (done < length) {
+                // what was written now belongs to the file's blocks, which always end on a block
+                int n = done / BLOCK_SIZE;
+                memmove(d->data,d->data + done,length - done);
+                delayedspace(fs,-n);
+                pthread_mutex_lock(&fs->lock);
+                d->base += done;
+                d->nblocks -= n;
+                pthread_mutex_unlock(&fs->lock);
+                printf("Could not write buffered data of inode %d\n",d->inumber);
+                return 0;
+        }
+
+        dropdelayed(fs,d);
+        return 1;
+}
+
+// flush every delayed buffer, taking the lock of each file in turn;
+// returns 0 if any of them could not be written
+static int flushalldelayed(struct fs *fs) {
+        int ok = 1;
+        for(int i=0;i<DELAYED_FILES;i++) {
+                pthread_mutex_lock(&fs->lock);
+                int inumber = fs->delayedfiles[i].inumber;
+                pthread_mutex_unlock(&fs->lock);
+                if (inumber == 0) continue;
+
+                // the buffer may have been flushed or dropped while the lock was awaited
+                lockinode(fs,inumber,1);
+                beginop(fs);
+                struct delayed *d = finddelayed(fs,inumber);
+                if (d != NULL && !flushdelayed(fs,d)) ok = 0;
+                endop(fs);
+                unlockinode(fs,inumber);
+        }
+        return ok;
+}
+
+// write every change to the disk and make it durable. A journal commit syncs the data
+// before the metadata that points at it; without a journal the inode table goes to the
+// cache, and the cache to the disk in block order, before the sync
+static int syncall(struct fs *fs) {
+        int ok = flushalldelayed(fs);
+        if (fs->journal && !commit(fs)) ok = 0;
+        else syncinodes(fs);
+        cache_flush(fs->cache);
+        if (!disk_sync(fs->disk)) ok = 0;
+
+        pthread_mutex_lock(&fs->lock);
+        fs->nsyncs++;
+        pthread_mutex_unlock(&fs->lock);
+        return ok;
+}
+
+// the end of a call that changed the filesystem, made with no inode lock held:
+// in strict mode the change is durable before the call returns, and in periodic mode
+// the background thread is woken early once enough blocks wait in memory
+static void syncpoint(struct fs *fs) {
+        if (fs->syncmode == FS_SYNC_STRICT) {
+                syncall(fs);
+        } else if (fs->syncmode == FS_SYNC_PERIODIC) {
+                struct cache_stats stats;
+                cache_getstats(fs->cache,&stats);
+                pthread_mutex_lock(&fs->lock);
+                if (stats.dirty + fs->ndelayedblocks >= fs->syncdirty) pthread_cond_signal(&fs->flushwake);
+                pthread_mutex_unlock(&fs->lock);
+        }
+}
+
+// the background thread: at every interval, or when woken early, it syncs everything
+// in periodic mode and otherwise commits the journal; the log is checkpointed once half full
+static void *flusher(void *arg) {
+        struct fs *fs = arg;
+        int interval = fs->syncmode == FS_SYNC_PERIODIC ? fs->syncinterval : JOURNAL_INTERVAL;
+
+        pthread_mutex_lock(&fs->lock);
+        while (!fs->stopflush) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME,&deadline);
+                deadline.tv_sec += interval / 1000;
+                deadline.tv_nsec += (interval % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&fs->flushwake,&fs->lock,&deadline);
+                if (fs->stopflush) break;
+                pthread_mutex_unlock(&fs->lock);
+
+                if (fs->syncmode == FS_SYNC_PERIODIC) syncall(fs);
+                else commit(fs);
+                if (fs->journal && journal_used(fs->journal) > journal_size(fs->journal) / 2) checkpoint(fs);
+
+                pthread_mutex_lock(&fs->lock);
+        }
+        pthread_mutex_unlock(&fs->lock);
+        return NULL;
+}
+
+// write for delayed allocation: the part of the write inside the file's allocated blocks
+// goes to them now, and the rest is kept in the file's buffer with space reserved for it
+static int delaywrite(struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, const unsigned char *data, int length, int offset) {
+        int allocated = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        int done = 0;
+
+        if (offset < allocated) {
+                int n = MIN(length,allocated - offset);
+                done = writeblocks(fs,inumber,inode,f,data,n,offset,NULL);
+                if (done < n || done == length) return done;
+                data += done;
+                offset += done;
+                length -= done;
+        }
+
+        struct delayed *d = finddelayed(fs,inumber);
+        int need = (offset + length - allocated + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        // a write too big to buffer, or one that finds the buffer space or the table of
+        // buffers used up, flushes the file's own buffer and goes straight to disk;
+        // other files are left alone, since flushing them would mean taking their locks
+        if (d == NULL && need <= DELAYED_BLOCKS)
+                d = claimdelayed(fs,inumber,allocated,inode->size);
+        if (d == NULL || need > DELAYED_BLOCKS || (need > d->nblocks && !delayedspace(fs,need - d->nblocks))) {
+                if (d != NULL && !flushdelayed(fs,d)) return done;
+                return done + writeblocks(fs,inumber,inode,f,data,length,offset,NULL);
+        }
+
+        if (need > d->nblocks) {
+                int reserve = delayedreserve(fs,need);
+                unsigned char *grown = realloc(d->data,(size_t)need*BLOCK_SIZE);
+                if (grown == NULL || (reserve > d->reserved && !reserveblocks(fs,reserve - d->reserved))) {
+                        if (grown == NULL) perror("malloc failed");
+                        else printf("Not enough free blocks\n");
+                        if (grown != NULL) d->data = grown;
+                        delayedspace(fs,d->nblocks - need);
+                        if (d->nblocks == 0) dropdelayed(fs,d);
+                        return done;
+                }
+                memset(grown + (size_t)d->nblocks*BLOCK_SIZE,0,(size_t)(need - d->nblocks)*BLOCK_SIZE);
+                d->data = grown;
+                d->nblocks = need;
+                d->reserved = MAX(reserve,d->reserved);
+        }
+
+        memcpy(d->data + (offset - d->base),data,length);
+        if (offset + length > d->size) d->size = offset + length;
+
+        return done + length;
+}
+
+struct fs * fs_init( struct disk *d )
+{
+	struct fs *fs = calloc(1, sizeof(*fs));
+	if (fs == NULL) {
+		perror("malloc failed");
+		return NULL;
+	}
+
+	fs->disk = d;
+	fs->mounted = (1==0);
+	fs->newfilegoal = -1;
+	fs->inodehint = 1;
+	fs->cache_capacity = 256;
+	fs->cache_policy = CACHE_LRU;
+	fs->syncinterval = SYNC_INTERVAL;
+	fs->syncdirty = SYNC_DIRTY;
+
+	pthread_mutex_init(&fs->alloclock, NULL);
+	pthread_mutex_init(&fs->tablelock, NULL);
+	pthread_mutex_init(&fs->lock, NULL);
+	pthread_mutex_init(&fs->commitlock, NULL);
+	pthread_cond_init(&fs->flushwake, NULL);
+	for (int i = 0; i < INODE_LOCKS; i++)
+		pthread_rwlock_init(&fs->inodelocks[i], NULL);
+
+	return fs;
+}
+
+void fs_destroy( struct fs *fs )
+{
+	if (fs == NULL)
+		return;
+
+	fs_unmount(fs);
+
+	pthread_mutex_destroy(&fs->alloclock);
+	pthread_mutex_destroy(&fs->tablelock);
+	pthread_mutex_destroy(&fs->lock);
+	pthread_mutex_destroy(&fs->commitlock);
+	pthread_cond_destroy(&fs->flushwake);
+	for (int i = 0; i < INODE_LOCKS; i++)
+		pthread_rwlock_destroy(&fs->inodelocks[i]);
+
+	free(fs);
+}
+
+int fs_format( struct fs *fs )
+{
+	return fs_format_layout(fs, FS_LAYOUT_BLOCKMAP);
+}
+
+int fs_format_layout( struct fs *fs, int layout )
+{
+	return fs_format_inodes(fs, layout, FS_INODE_SIZE);
+}
+
+int fs_format_inodes( struct fs *fs, int layout, int inodesize )
 {
-	// Determine NINODEBLOCKS
-	int nblocks = disk_nblocks(thedisk);
+	if (layout != FS_LAYOUT_BLOCKMAP && layout != FS_LAYOUT_EXTENTS && layout != FS_LAYOUT_COMPRESSED) {
+		printf("Unknown layout\n");
+		return 0;
+	}
+
+	// a slot is the plain inode or a power of two that leaves room after it
+	if (inodesize != FS_INODE_SIZE &&
+	    (inodesize <= FS_INODE_SIZE || inodesize > BLOCK_SIZE || (inodesize & (inodesize - 1)) != 0)) {
+		printf("Invalid inode size\n");
+		return 0;
+	}
+
+	if (fs->mounted == (1==1)) {
+		printf("Cannot format a mounted disk\n");
+		return 0;
+	}
+
+	// Determine NINODEBLOCKS, and the bitmap and journal blocks that follow them
+	int nblocks = disk_nblocks(fs->disk);
 	int ninodes = (int) ceil(nblocks / 10.0);
+	int nbitmap = (nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	int njournal = MIN(nblocks / 32, JOURNAL_MAX);
+	if (njournal < JOURNAL_MIN)
+		njournal = 0;
+	if (ninodes + 1 + nbitmap + njournal >= nblocks) {
+		printf("Disk too small\n");
+		return 0;
+	}
+	if (nblocks > MAX_BLOCKS) {
+		printf("Disk too large\n");
+		return 0;
+	}
 	
 	// Declare Block B
 	union fs_block block;
+	memset(block.data,0,BLOCK_SIZE);
 
 	// Fill in Superblock in B
 	block.super.magic = FS_MAGIC;
 	block.super.nblocks = nblocks;
 	block.super.ninodeblocks = ninodes;
-	block.super.ninodes = ninodes * INODES_PER_BLOCK;
-	disk_write(thedisk,0,block.data);
-
-	// Fill in inode Blocks in B
+	block.super.ninodes = ninodes * (BLOCK_SIZE / inodesize);
+	block.super.flags = FS_CLEAN | (layout == FS_LAYOUT_EXTENTS ? FS_EXTENTS : 0) | (njournal > 0 ? FS_JOURNAL : 0) |
+	                    (inodesize > FS_INODE_SIZE ? FS_INLINE : 0) | (layout == FS_LAYOUT_COMPRESSED ? FS_COMPRESS : 0);
+	block.super.bitmapstart = ninodes + 1;
+	block.super.nbitmapblocks = nbitmap;
+	block.super.journalstart = njournal > 0 ? ninodes + 1 + nbitmap : 0;
+	block.super.njournalblocks = njournal;
+	block.super.inodesize = inodesize > FS_INODE_SIZE ? inodesize : 0;
+	fs->super = block.super;
+	disk_write(fs->disk,0,block.data);
+
+	// Fill in inode Blocks in B; every slot, whatever its size, starts out all zeros
+	memset(block.data,0,BLOCK_SIZE);
 	for (int i=0; i<ninodes; i++)
-	{
-		for (int j=0; j<INODES_PER_BLOCK; j++)
-		{
-			block.inode[j].isvalid = 0;
-			block.inode[j].size = 0;
-			block.inode[j].ctime = 0;
-			for (int k=0; k<POINTERS_PER_INODE; k++)
-			{
-				block.inode[j].direct[k] = 0;
-			}
-			block.inode[j].indirect = 0;
-		}
-		disk_write(thedisk,i+1,block.data);
+		disk_write(fs->disk,i+1,block.data);
+
+	// Start with an empty journal
+	if (njournal > 0)
+		journal_format(fs->disk,ninodes + 1 + nbitmap,njournal);
+
+	// Write the bitmap, with everything past the metadata free
+	fs->freeblock = bitmap_create(nblocks);
+	if (fs->freeblock == NULL) {
+		perror("malloc failed");
+		return 0;
+	}
+	bitmap_setall(fs->freeblock);
+	for (int i=0; i < ninodes + 1 + nbitmap + njournal; i++)
+		bitmap_clear(fs->freeblock,i);
+	int ok = bitmapio(fs, 1);
+	bitmap_destroy(fs->freeblock);
+	fs->freeblock = NULL;
+	if (!ok) {
+		perror("malloc failed");
+		return 0;
 	}
 
 	return 1;
 }
 
-void fs_debug()
+void fs_debug( struct fs *fs )
 {
 	// read and print super block
 	union fs_block block;
-	disk_read(thedisk,0,block.data);
-	struct fs_superblock superblock = block.super;
+	struct fs_superblock superblock;
+	if (fs->mounted == (1==1)) {
+		superblock = fs->super;
+	} else {
+		bread(fs,0,block.data);
+		superblock = block.super;
+	}
 
 	printf("superblock:\n");
 	printf("    %d blocks\n",superblock.nblocks);
 	printf("    %d inode blocks\n",superblock.ninodeblocks);
 	printf("    %d inodes\n",superblock.ninodes);
+	if (superblock.nbitmapblocks != 0)
+		printf("    %d bitmap blocks\n",superblock.nbitmapblocks);
+	if (superblock.flags & FS_EXTENTS)
+		printf("    extent-mapped files\n");
+	if (superblock.flags & FS_JOURNAL)
+		printf("    %d journal blocks\n",superblock.njournalblocks);
+	if (superblock.flags & FS_INLINE)
+		printf("    %d-byte inodes, small files inline\n",superblock.inodesize);
+	if (superblock.flags & FS_COMPRESS)
+		printf("    new files compressed\n");
+	int slot = slotsize(&superblock);
+	int perblock = BLOCK_SIZE / slot;
 
 	// loop through inodes
 	for (int i = 0; i < superblock.ninodeblocks; i++) {
 
-		// read inode block
-		disk_read(thedisk,i+1,block.data);
+		// use the resident inode block, or read it
+		union fs_block *ib = &block;
+		if (fs->mounted == (1==1))
+			ib = &fs->inodetable[i];
+		else
+			bread(fs,i+1,block.data);
 		
 		// loop through inodes in block
-		for (int j=0; j < INODES_PER_BLOCK; j++) {
+		for (int j=0; j < perblock; j++) {
+			struct fs_inode *inode = (struct fs_inode *)(ib->data + j*slot);
+
 			// skip invalid inodes
-			if (block.inode[j].isvalid == 0)
+			if (inode->isvalid == 0)
+				continue;
+
+
+			// print inode info
+			printf("inode %d:\n",i*perblock + j);
+			printf("    valid: YES\n");
+			printf("    size: %d bytes\n",inode->size);
+			printf("    created: %s",ctime(&inode->ctime));
+
+			// an inline file has no blocks at all
+			if (inode->isvalid & INODE_INLINE) {
+				printf("    inline data\n");
+				continue;
+			}
+
+			// an extent-mapped inode lists its runs of blocks instead
+			if (superblock.flags & FS_EXTENTS) {
+				printextents(fs, inode);
 				continue;
+			}
 
+			if (inode->isvalid & INODE_COMPRESSED)
+				printf("    compressed in clusters of %d blocks\n",CLUSTER_BLOCKS);
 
-			// print inode info
-			printf("inode %d:\n",i*INODES_PER_BLOCK + j);
-			printf("    valid: YES\n");
-			printf("    size: %d bytes\n",block.inode[j].size);
-			printf("    created: %s",ctime(&block.inode[j].ctime));
 			printf("    direct blocks:");
 
 
 			// loop through direct pointers
 			for (int k=0; k < POINTERS_PER_INODE; k++) {
 				// print direct pointers
-				if (block.inode[j].direct[k] != 0)
-					printf(" %d",block.inode[j].direct[k]);
+				if (inode->direct[k] != 0)
+					printf(" %d",POINTER_BLOCK(inode->direct[k]));
 			}
 			printf("\n");
 
 			// print indirect pointer
-			if (block.inode[j].indirect != 0) {
-				printf("    indirect blocks (in block %d): ",block.inode[j].indirect);
+			if (inode->indirect != 0) {
+				printf("    indirect blocks (in block %d): ",inode->indirect);
 				
 				// read indirect block
 				union fs_block indirectblock;
-				disk_read(thedisk,block.inode[j].indirect,indirectblock.data);
+				bread(fs,inode->indirect,indirectblock.data);
 
 				for (int l=0; l < POINTERS_PER_BLOCK; l++) {
 					// print indirect pointers
 					if (indirectblock.pointers[l] != 0)
-						printf(" %d",indirectblock.pointers[l]);
+						printf(" %d",POINTER_BLOCK(indirectblock.pointers[l]));
 				}
 				printf("\n");
 			}
@@ -198,17 +1988,17 @@ void fs_debug()
 	}
 }
 
-int fs_mount()
+int fs_mount( struct fs *fs )
 {
 	// Mount Filesystem
-	if (mounted == (1==1)) {
+	if (fs->mounted == (1==1)) {
 		printf("Already mounted\n");
 		return 0;
 	}
 	
 	// Load Super Block
 	union fs_block block;
-	disk_read(thedisk,0,block.data);
+	disk_read(fs->disk,0,block.data);
 
 	if(block.super.magic != FS_MAGIC){
 		printf("Magic Number Incorrect\n");
@@ -220,515 +2010,1065 @@ int fs_mount()
 		return 0;
 	}
 
-	if (freeblock) free(freeblock);
-	unsigned int nb = disk_nblocks(thedisk);
-	nbrfreeblks = nb;
-	unsigned int nfbb = nb*sizeof(unsigned char)/8 + ((nb%8) != 0) ? 1 : 0;
-	freeblock = (unsigned char *)malloc(nfbb);
-    if (freeblock == NULL) { perror("malloc failed"); return 0; }
+	if(block.super.ninodeblocks >= block.super.nblocks || block.super.nblocks > disk_nblocks(fs->disk) ||
+	   block.super.nblocks > MAX_BLOCKS){
+		printf("Superblock does not match the disk\n");
+		return 0;
+	}
 
-	// initialize free block bitmap
-	for(int i = 0; i < nb; i++)
-		markfree(i);
+	if((block.super.flags & ~(FS_CLEAN | FS_EXTENTS | FS_JOURNAL | FS_INLINE | FS_COMPRESS)) ||
+	   ((block.super.flags & FS_COMPRESS) && (block.super.flags & FS_EXTENTS))){
+		printf("Unsupported filesystem features\n");
+		return 0;
+	}
 
-	// mark super block and inode blocks as used
-	markused(0);
-	nbrfreeblks--;
-	for(int i = 0; i < block.super.ninodeblocks; i++){
-		markused(i + 1);
-		nbrfreeblks--;
+	if(block.super.nbitmapblocks != 0 &&
+	   (block.super.bitmapstart != block.super.ninodeblocks + 1 ||
+	    block.super.bitmapstart + block.super.nbitmapblocks > block.super.nblocks ||
+	    (uint64_t)block.super.nbitmapblocks * BITS_PER_BLOCK < block.super.nblocks)){
+		printf("Superblock does not match the disk\n");
+		return 0;
 	}
-		
-	// mark used blocks
-	for(int i = 0; i < block.super.ninodes; i++) {
-		disk_read(thedisk,i+1,block.data);
 
-		// loop through inodes in block
-		for(int j = 0; j < INODES_PER_BLOCK; j++) {
-			if(block.inode[j].isvalid == 0) continue;
-
-			// mark direct pointers
-			for(int k = 0; k < POINTERS_PER_INODE; k++) {
-				if(block.inode[j].direct[k] == 0) continue;
-				markused(block.inode[j].direct[k]);
-				nbrfreeblks--;
-			}
+	if((block.super.flags & FS_JOURNAL) &&
+	   (block.super.nbitmapblocks == 0 ||
+	    block.super.journalstart != block.super.bitmapstart + block.super.nbitmapblocks ||
+	    block.super.journalstart + block.super.njournalblocks > block.super.nblocks)){
+		printf("Superblock does not match the disk\n");
+		return 0;
+	}
 
-			// check indirect block
-			if(block.inode[j].indirect == 0) continue;
-			
-			markused(block.inode[j].indirect);
-			nbrfreeblks--;
-			
-			// mark indirect pointers
-			disk_read(thedisk,block.inode[j].indirect,block.data);
-			for(int k = 0; k < POINTERS_PER_BLOCK; k++) {
-				if(block.pointers[k] == 0) continue;
-				markused(block.pointers[k]);
-				nbrfreeblks--;
-			}
+	if((block.super.flags & FS_INLINE) &&
+	   (block.super.inodesize <= FS_INODE_SIZE || block.super.inodesize > BLOCK_SIZE ||
+	    (block.super.inodesize & (block.super.inodesize - 1)) != 0 ||
+	    block.super.ninodes != block.super.ninodeblocks * (BLOCK_SIZE / block.super.inodesize))){
+		printf("Superblock does not match the disk\n");
+		return 0;
+	}
+
+	fs->super = block.super;
+	fs->inodesize = slotsize(&fs->super);
+	fs->inodesperblock = BLOCK_SIZE / fs->inodesize;
+	fs->inlinemax = fs->super.flags & FS_INLINE ? fs->inodesize - (int)INLINE_START : 0;
+
+	// Bring the metadata up to date from the journal; this reads the log, not the disk
+	int needscan = 0;
+	if (fs->super.flags & FS_JOURNAL) {
+		int replayed = journal_recover(fs->disk,fs->super.journalstart,fs->super.njournalblocks,&needscan);
+		if (replayed < 0) {
+			printf("Journal is damaged\n");
+			return 0;
 		}
+		if (replayed > 0)
+			printf("Replayed %d journal transactions\n",replayed);
+	}
+
+	// A mapped disk is its own cache, so blocks go straight to the mapping;
+	// a journaled inode table must not reach the disk before it is logged, so it stays resident
+	fs->diskmapped = disk_block_ptr(fs->disk,0) != NULL;
+	fs->tablemapped = fs->diskmapped && !(fs->super.flags & FS_JOURNAL);
+
+	// Set up the block cache
+	fs->cache = cache_create(fs->disk,fs->diskmapped ? 0 : fs->cache_capacity,fs->cache_policy);
+	if (fs->cache == NULL) { printf("Couldn't create block cache\n"); return 0; }
+
+	// Load the inode table, or use it in place in the mapping
+	if (fs->tablemapped)
+		fs->inodetable = (union fs_block *)disk_block_ptr(fs->disk,1);
+	else
+		fs->inodetable = aligned_alloc(BLOCK_SIZE,fs->super.ninodeblocks*sizeof(union fs_block));
+	fs->inodedirty = calloc(fs->super.ninodeblocks,sizeof(unsigned char));
+	fs->dirtylist = malloc(fs->super.ninodeblocks*sizeof(int));
+	fs->ndirty = 0;
+	if (fs->inodetable == NULL || fs->inodedirty == NULL || fs->dirtylist == NULL) {
+		perror("malloc failed");
+		fs_release(fs);
+		return 0;
+	}
+
+	if (!fs->tablemapped)
+		disk_read_range(fs->disk,1,fs->super.ninodeblocks,fs->inodetable[0].data);
+
+	unsigned int nb = fs->super.nblocks;
+	fs->freeblock = bitmap_create(nb);
+	fs->freeinode = bitmap_create(fs->super.ninodes);
+	fs->freeing = bitmap_create(nb);
+	fs->freed = bitmap_create(nb);
+	fs->bitmapdirty = bitmap_create(fs->super.nbitmapblocks);
+	fs->nreserved = 0;
+	fs->newfilegoal = -1;
+	if (fs->freeblock == NULL || fs->freeinode == NULL || fs->freeing == NULL || fs->freed == NULL || fs->bitmapdirty == NULL) {
+		perror("malloc failed");
+		fs_release(fs);
+		return 0;
+	}
+
+	fs->ra_blocks = fs->ra_hits = fs->ra_misses = 0;
+	fs->nclusters = fs->nwhole = fs->nsaved = 0;
+
+	// note the free inodes; inode 0 is never handed out
+	for (int i = 1; i < fs->super.ninodes; i++)
+		if (getinode(fs, i)->isvalid == 0) bitmap_set(fs->freeinode,i);
+	fs->inodehint = 1;
+
+	// after a clean unmount or a journal replay the bitmap on disk is exact; otherwise rebuild it
+	int loaded = 0;
+	if (fs->super.nbitmapblocks != 0) {
+		if ((fs->super.flags & FS_CLEAN) || ((fs->super.flags & FS_JOURNAL) && !needscan))
+			loaded = bitmapio(fs, 0);
+		else
+			printf("Not cleanly unmounted, rebuilding free block bitmap\n");
+	}
+
+	if (!loaded && !scanblocks(fs)) {
+		perror("malloc failed");
+		fs_release(fs);
+		return 0;
+	}
+
+	// a rebuilt bitmap is stored before the journal is trusted with it again
+	if (fs->super.flags & FS_JOURNAL) {
+		if (!loaded && bitmapio(fs, 1))
+			disk_sync(fs->disk);
+		fs->journal = journal_open(fs->disk,fs->cache,fs->super.journalstart,fs->super.njournalblocks);
+		if (fs->journal == NULL) {
+			printf("Journal is damaged\n");
+			fs_release(fs);
+			return 0;
+		}
+	}
+
+	// until the next clean unmount, the bitmap on disk cannot be trusted
+	if (fs->super.nbitmapblocks != 0) {
+		writesuper(fs, 0);
+		disk_sync(fs->disk);
+	}
+
+	fs->mounted = (1==1);
+
+	// commits, checkpoints and periodic syncs happen in the background
+	if (fs->journal != NULL || fs->syncmode == FS_SYNC_PERIODIC) {
+		fs->stopflush = 0;
+		fs->flushrunning = pthread_create(&fs->flushthread,NULL,flusher,fs) == 0;
 	}
 
-	mounted = (1==1);
-	
 	return 1;
 }
 
-int fs_create()
+int fs_unmount( struct fs *fs )
 {
-	// check if mounted
-	if (mounted == (1==0)) {
-		printf("Not mounted\n");
+	// unmounting an unmounted disk does nothing
+	if (fs->mounted == (1==0))
 		return 0;
+
+	if (fs->flushrunning) {
+		pthread_mutex_lock(&fs->lock);
+		fs->stopflush = 1;
+		pthread_cond_signal(&fs->flushwake);
+		pthread_mutex_unlock(&fs->lock);
+		pthread_join(fs->flushthread,NULL);
+		fs->flushrunning = 0;
 	}
 
-	// read super block
-	union fs_block block;
-	disk_read(thedisk,0,block.data);
-	struct fs_superblock superblock = block.super;
-	int ninodeblocks = superblock.ninodeblocks;
+	// place and write delayed data, then write back the inode table,
+	// or commit it and everything else and write it home,
+	// then every cached block, then make it durable.
+	// Delayed data that cannot be placed is lost, and the unmount reports it
+	int ok = flushalldelayed(fs);
+	if (fs->journal) {
+		commit(fs);
+		checkpoint(fs);
+	}
+	syncinodes(fs);
+	cache_flush(fs->cache);
 
+	// store the bitmap, and only once it is durable mark the filesystem clean
+	if (fs->super.nbitmapblocks != 0 && bitmapio(fs, 1)) {
+		disk_sync(fs->disk);
+		writesuper(fs, 1);
+	}
+	disk_sync(fs->disk);
+	fs_release(fs);
 
-	// loop through inode blocks
-	for (int i=0; i<ninodeblocks; i++) {
-		// read inode block
-		disk_read(thedisk,i+1,block.data);
+	fs->mounted = (1==0);
 
-		// loop through inodes in block
-		for (int j=0; j < INODES_PER_BLOCK; j++) {
+	return ok;
+}
 
-			// skip inode 0
-			if (i == 0 && j == 0)
-				continue;
+int fs_setcache( struct fs *fs, int capacity, int policy )
+{
+	if (fs->mounted == (1==1)) {
+		printf("Cannot change the cache while mounted\n");
+		return 0;
+	}
 
-			// break if isvalid not set
-			if (block.inode[j].isvalid == 0) {
-				// set inode
-				block.inode[j].isvalid = 1;
-				block.inode[j].size = 0;
-				block.inode[j].ctime = time(NULL);
+	if (capacity < 0 || (policy != CACHE_LRU && policy != CACHE_CLOCK)) {
+		printf("Invalid cache settings\n");
+		return 0;
+	}
 
-				// set direct pointers
-				for (int k=0; k < POINTERS_PER_INODE; k++)
-					block.inode[j].direct[k] = 0;
+	fs->cache_capacity = capacity;
+	fs->cache_policy = policy;
 
-				// set indirect pointer
-				block.inode[j].indirect = 0;
+	return 1;
+}
 
-				// write inode block
-				disk_write(thedisk,i+1,block.data);
+int fs_setdelalloc( struct fs *fs, int on )
+{
+	// buffered data is placed before the mode goes off
+	if (!on && fs->mounted == (1==1) && !flushalldelayed(fs))
+		return 0;
 
-				// return inode number
-				return i*INODES_PER_BLOCK + j;
-			}
-		}
+	fs->delalloc = on;
+
+	return 1;
+}
+
+int fs_setsync( struct fs *fs, int mode, int interval, int dirty )
+{
+	if (fs->mounted == (1==1)) {
+		printf("Cannot change the sync mode while mounted\n");
+		return 0;
+	}
+
+	if ((mode != FS_SYNC_NONE && mode != FS_SYNC_PERIODIC && mode != FS_SYNC_STRICT) || interval <= 0 || dirty <= 0) {
+		printf("Invalid sync settings\n");
+		return 0;
 	}
 
-	// empty inode not found
-	printf("No empty inode\n");
-	return 0;
+	fs->syncmode = mode;
+	fs->syncinterval = interval;
+	fs->syncdirty = dirty;
+
+	return 1;
 }
 
-int fs_delete( int inumber )
+int fs_setcompress( struct fs *fs, int inumber, int on )
 {
-	// check if mounted
-	if (mounted == (1==0)) {
+	if (fs->mounted == (1==0)) {
 		printf("Not mounted\n");
 		return 0;
 	}
 
-	// read super block
-	union fs_block block;
-	disk_read(thedisk,0,block.data);
-	struct fs_superblock superblock = block.super;
-	int ninodes = superblock.ninodes;
-
-	// check if inumber is valid
-	if (inumber < 1 || inumber > ninodes) {
-		printf("Invalid inumber\n");
+	if (EXTENTS(fs)) {
+		printf("Only block-mapped files can be compressed\n");
 		return 0;
 	}
 
-	// read inode block
-	int inodeblock = inumber/INODES_PER_BLOCK + 1;
-	int inodeindex = inumber%INODES_PER_BLOCK;
+	lockinode(fs, inumber, 1);
+	beginop(fs);
+	struct fs_inode *inode = validinode(fs, inumber);
+	int ok = inode != NULL;
 
-	disk_read(thedisk,inodeblock,block.data);
+	// a file's blocks are laid out one way or the other from the first one on
+	if (ok && !(inode->isvalid & INODE_INLINE) && filesize(fs, inumber, inode) > 0) {
+		printf("File already has data blocks\n");
+		ok = 0;
+	}
 
-	// check if inode is valid
-	if (block.inode[inodeindex].isvalid == 0) {
-		printf("Inode not valid\n");
-		return 0;
+	if (ok) {
+		if (on)
+			inode->isvalid |= INODE_COMPRESSED;
+		else
+			inode->isvalid &= ~INODE_COMPRESSED;
+		dirtyinode(fs, inumber);
 	}
+	endop(fs);
+	unlockinode(fs, inumber);
 
-	// free direct pointers
-	for (int i=0; i < POINTERS_PER_INODE; i++) {
-		if (block.inode[inodeindex].direct[i] == 0)
-			continue;
+	syncinodes(fs);
+	if (ok)
+		syncpoint(fs);
+
+	return ok;
+}
 
-		markfree(block.inode[inodeindex].direct[i]);
-		block.inode[inodeindex].direct[i] = 0;
-		nbrfreeblks++;
+int fs_flush( struct fs *fs )
+{
+	if (fs->mounted == (1==0)) {
+		printf("Not mounted\n");
+		return 0;
 	}
 
-	// free indirect pointers
-	if (block.inode[inodeindex].indirect != 0) {
-		// read indirect block
-		union fs_block indirectblock;
-		disk_read(thedisk,block.inode[inodeindex].indirect,indirectblock.data);
+	int ok = flushalldelayed(fs);
+	if (fs->journal && !commit(fs))
+		ok = 0;
+	cache_flush(fs->cache);
 
-		for (int i=0; i < POINTERS_PER_BLOCK; i++) {
-			if (indirectblock.pointers[i] == 0)
-				continue;
+	return ok;
+}
 
-			markfree(indirectblock.pointers[i]);
-			indirectblock.pointers[i] = 0;
-			nbrfreeblks++;
-		}
+int fs_sync( struct fs *fs )
+{
+	if (fs->mounted == (1==0)) {
+		printf("Not mounted\n");
+		return 0;
+	}
+
+	return syncall(fs);
+}
 
-		disk_write(thedisk,block.inode[inodeindex].indirect,indirectblock.data);
+void fs_stats( struct fs *fs )
+{
+	printf("disk (%s):\n",disk_backend(fs->disk));
+	printf("    %d read calls\n",disk_nreads(fs->disk));
+	printf("    %d write calls\n",disk_nwrites(fs->disk));
+
+	if (fs->cache == NULL)
+		return;
+
+	struct cache_stats stats;
+	cache_getstats(fs->cache,&stats);
+
+	printf("cache:\n");
+	printf("    %d blocks, %s\n",fs->cache_capacity,fs->cache_policy == CACHE_CLOCK ? "clock" : "lru");
+	printf("    %ld hits\n",stats.hits);
+	printf("    %ld misses\n",stats.misses);
+	printf("    %ld writebacks\n",stats.writebacks);
+	printf("    %ld dirty\n",stats.dirty);
+
+	pthread_mutex_lock(&fs->lock);
+	if (fs->delalloc) {
+		int nfiles = 0;
+		for (int i = 0; i < DELAYED_FILES; i++)
+			if (fs->delayedfiles[i].inumber != 0) nfiles++;
+		printf("delayed allocation:\n");
+		printf("    %d files, %d blocks buffered\n",nfiles,fs->ndelayedblocks);
+	}
 
-		block.inode[inodeindex].indirect = 0;
-		markfree(block.inode[inodeindex].indirect);
-		nbrfreeblks++;
+	printf("readahead:\n");
+	printf("    %ld blocks prefetched\n",fs->ra_blocks);
+	printf("    %ld hits\n",fs->ra_hits);
+	printf("    %ld misses\n",fs->ra_misses);
+
+	printf("sync:\n");
+	if (fs->syncmode == FS_SYNC_PERIODIC)
+		printf("    periodic, every %d ms or %d dirty blocks\n",fs->syncinterval,fs->syncdirty);
+	else
+		printf("    %s\n",fs->syncmode == FS_SYNC_STRICT ? "strict" : "none");
+	printf("    %ld syncs\n",fs->nsyncs);
+
+	if (fs->nclusters + fs->nwhole > 0) {
+		printf("compression:\n");
+		printf("    %ld clusters compressed, %ld stored whole\n",fs->nclusters,fs->nwhole);
+		printf("    %ld blocks saved\n",fs->nsaved);
 	}
+	pthread_mutex_unlock(&fs->lock);
 
-	// set inode to invalid
-	block.inode[inodeindex].isvalid = 0;
-	block.inode[inodeindex].size = 0;
-	block.inode[inodeindex].ctime = 0;
+	if (fs->journal == NULL)
+		return;
 
-	// write inode block
-	disk_write(thedisk,inodeblock,block.data);
+	pthread_mutex_lock(&fs->commitlock);
+	printf("journal:\n");
+	printf("    %d of %d blocks in use\n",journal_used(fs->journal),journal_size(fs->journal));
+	printf("    %ld commits\n",fs->ncommits);
+	printf("    %ld checkpoints\n",fs->ncheckpoints);
+	pthread_mutex_unlock(&fs->commitlock);
+}
 
-	return 1;
+int fs_create( struct fs *fs )
+{
+	int inumber;
+
+	if (fs_create_many(fs, 1, &inumber) != 1)
+		return 0;
+
+	return inumber;
 }
 
-int fs_getsize( int inumber )
+int fs_create_many( struct fs *fs, int n, int *inumbers )
 {
 	// check if mounted
-	if (mounted == (1==0)) {
+	if (fs->mounted == (1==0)) {
 		printf("Not mounted\n");
-		return -1;
+		return 0;
 	}
 
-	// read super block
-	union fs_block block;
-	disk_read(thedisk,0,block.data);
-	struct fs_superblock superblock = block.super;
-	int ninodes = superblock.ninodes;
-
-	// check if inumber is valid
-	if (inumber < 1 || inumber > ninodes) {
-		printf("Invalid inumber\n");
-		return -1;
-	}
+	int created = 0;
+	while (created < n) {
+		// take the lowest free inode
+		pthread_mutex_lock(&fs->alloclock);
+		int inumber = bitmap_find_next(fs->freeinode, fs->inodehint);
+		if (inumber >= 0) {
+			bitmap_clear(fs->freeinode, inumber);
+			fs->inodehint = inumber + 1;
+		}
+		pthread_mutex_unlock(&fs->alloclock);
+		if (inumber < 0) {
+			printf("No empty inode\n");
+			break;
+		}
 
-	// read inode block
-	int inodeblock = inumber/INODES_PER_BLOCK + 1;
-	int inodeindex = inumber%INODES_PER_BLOCK;
+		// a delete that just freed it may still hold its lock
+		lockinode(fs, inumber, 1);
+		beginop(fs);
+		struct fs_inode *inode = getinode(fs, inumber);
+		inode->isvalid = 1;
+		inode->size = 0;
+		inode->ctime = time(NULL);
+
+		// set direct pointers
+		for (int k=0; k < POINTERS_PER_INODE; k++)
+			inode->direct[k] = 0;
+
+		// set indirect pointer
+		inode->indirect = 0;
+
+		// with room in the slot, a new file starts out inline
+		if (fs->inlinemax > 0) {
+			memset(inlinedata(inode), 0, fs->inlinemax);
+			inode->isvalid |= INODE_INLINE;
+		}
 
-	disk_read(thedisk,inodeblock,block.data);
+		// and on a compressed filesystem its blocks are compressed
+		if (fs->super.flags & FS_COMPRESS)
+			inode->isvalid |= INODE_COMPRESSED;
+		dirtyinode(fs, inumber);
+		endop(fs);
+		unlockinode(fs, inumber);
 
-	// check if inode is valid
-	if (block.inode[inodeindex].isvalid == 0) {
-		printf("Inode not valid\n");
-		return -1;
+		inumbers[created++] = inumber;
 	}
 
-	return block.inode[inodeindex].size;
+	// write each touched inode block once
+	syncinodes(fs);
+	if (created > 0)
+		syncpoint(fs);
+
+	return created;
+}
+
+int fs_delete( struct fs *fs, int inumber )
+{
+	return fs_delete_many(fs, &inumber, 1) == 1;
 }
 
-int fs_read( int inumber, unsigned char *data, int length, int offset )
+int fs_delete_many( struct fs *fs, const int *inumbers, int n )
 {
 	// check if mounted
-	if (mounted == (1==0)) {
+	if (fs->mounted == (1==0)) {
 		printf("Not mounted\n");
 		return 0;
 	}
 
-	// read super block
-	union fs_block block;
-	disk_read(thedisk,0,block.data);
-	struct fs_superblock superblock = block.super;
-	int ninodes = superblock.ninodes;
+	if (n <= 0)
+		return 0;
 
-	// check if inumber is valid
-	if (inumber < 1 || inumber > ninodes) {
-		printf("Invalid inumber\n");
+	int indirect[DELETE_BATCH];
+	unsigned char *bufs[DELETE_BATCH];
+	unsigned char *readbufs[DELETE_BATCH];
+	int todo[DELETE_BATCH];
+	int hasmeta[DELETE_BATCH];
+	unsigned char *pool = aligned_alloc(BLOCK_SIZE, MIN(n, DELETE_BATCH)*BLOCK_SIZE);
+	if (pool == NULL) {
+		perror("malloc failed");
 		return 0;
 	}
 
-	// read inode block
-	int inodeblock = inumber/INODES_PER_BLOCK + 1;
-	int inodeindex = inumber%INODES_PER_BLOCK;
+	int deleted = 0;
+	for (int first = 0; first < n; first += DELETE_BATCH) {
+		int ntodo = 0;
+		int nindirect = 0;
+		uint64_t locked = lockinodes(fs, inumbers + first, MIN(n - first, DELETE_BATCH));
+		beginop(fs);
+
+		// check every inode of this part of the list and note the indirect block or
+		// extent tree root it has; clearing isvalid right away keeps an inode
+		// listed twice from being freed twice
+		for (int i = first; i < n && i < first + DELETE_BATCH; i++) {
+			struct fs_inode *inode = validinode(fs, inumbers[i]);
+			if (inode == NULL)
+				continue;
+			// an inline file has no blocks; its contents are wiped so that
+			// releaseinode finds an empty block map where they were
+			int meta = 0;
+			if (inode->isvalid & INODE_INLINE)
+				memset(inlinedata(inode), 0, fs->inlinemax);
+			else if (EXTENTS(fs) && (inode->isvalid & INODE_EXTENT_TREE))
+				meta = inode->extent[0].start;
+			else if (!EXTENTS(fs))
+				meta = inode->indirect;
+			inode->isvalid = 0;
+			todo[ntodo] = inumbers[i];
+			hasmeta[ntodo++] = meta != 0;
+			if (meta != 0) {
+				indirect[nindirect] = meta;
+				bufs[nindirect] = pool + nindirect*BLOCK_SIZE;
+				nindirect++;
+			}
+		}
+
+		// read all those blocks with one vectored request,
+		// except the ones the journal has newer copies of
+		int nread = 0;
+		for (int i = 0; i < nindirect; i++) {
+			if (fs->journal && journal_read(fs->journal, indirect[i], bufs[i]))
+				continue;
+			indirect[nread] = indirect[i];
+			readbufs[nread++] = bufs[i];
+		}
+		cache_readv(fs->cache, indirect, readbufs, nread);
+
+		nindirect = 0;
+		for (int i = 0; i < ntodo; i++) {
+			union fs_block *meta = NULL;
+			if (hasmeta[i])
+				meta = (union fs_block *)bufs[nindirect++];
+			releaseinode(fs, todo[i], meta);
+			deleted++;
+		}
+		endop(fs);
+		unlockinodes(fs, locked);
+	}
+
+	free(pool);
+
+	// write each touched inode block once
+	syncinodes(fs);
+	if (deleted > 0)
+		syncpoint(fs);
+
+	return deleted;
+}
+
+int fs_getsize( struct fs *fs, int inumber )
+{
+	// check if mounted
+	if (fs->mounted == (1==0)) {
+		printf("Not mounted\n");
+		return -1;
+	}
+
+	// check if inumber is valid
+	lockinode(fs, inumber, 0);
+	struct fs_inode *inode = validinode(fs, inumber);
+	int size = inode != NULL ? filesize(fs, inumber, inode) : -1;
+	unlockinode(fs, inumber);
 
-	disk_read(thedisk,inodeblock,block.data);
-	struct fs_inode inode = block.inode[inodeindex];
+	return size;
+}
 
-	// check if inode is valid
-	if (inode.isvalid == 0) {
-		printf("Inode not valid\n");
+int fs_read( struct fs *fs, int inumber, unsigned char *data, int length, int offset )
+{
+	// check if mounted
+	if (fs->mounted == (1==0)) {
+		printf("Not mounted\n");
 		return 0;
 	}
 
-	// check if offset is valid
+	// check if inumber is valid
+	lockinode(fs, inumber, 0);
+	struct fs_inode *inode = validinode(fs, inumber);
+	int result = inode != NULL ? readfile(fs, inumber, inode, NULL, data, length, offset) : 0;
+	unlockinode(fs, inumber);
+
+	return result;
+}
 
-	if (offset < 0 || offset > inode.size) {
+// read up to length bytes at offset of a valid inode; f is the handle the read
+// goes through, whose block map spares looking up blocks it already holds
+static int readfile( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, unsigned char *data, int length, int offset )
+{
+	// check if offset is valid
+	int size = filesize(fs, inumber, inode);
+	if (offset < 0 || offset > size) {
 		printf("Invalid offset\n");
 		return 0;
 	}
 
-	if (offset == inode.size) {
+	if (offset == size || length <= 0) {
 		return 0;
 	}
 
 	// adjust length if necessary
-	if (offset + length > inode.size)
-		length = inode.size - offset;
-
-	// read data
-	int bytesread = 0;
-
-	for (int i=0; i < POINTERS_PER_INODE; i++) {
-		if (inode.direct[i] == 0)
-			continue;
+	if (length > size - offset)
+		length = size - offset;
+
+	// a small file is read from its inode
+	if (inode->isvalid & INODE_INLINE) {
+		memcpy(data, inlinedata(inode) + offset, length);
+		if (DEBUG) printf("bytesread: %d\n",length);
+		return length;
+	}
 
-		if (offset > BLOCK_SIZE) {
-			offset -= BLOCK_SIZE;
-			continue;
+	// data past the allocated blocks comes from the delayed-allocation buffer
+	int total = length;
+	struct delayed *d = finddelayed(fs, inumber);
+	if (d != NULL && offset + length > d->base) {
+		int from = MAX(offset, d->base);
+		memcpy(data + (from - offset), d->data + (from - d->base), offset + length - from);
+		length = from - offset;
+		if (length == 0) {
+			if (DEBUG) printf("bytesread: %d\n",total);
+			return total;
 		}
+	}
 
-		disk_read(thedisk, inode.direct[i],block.data);
-		unsigned char *blockdata = block.data;
-
-		// partial block read at beginning
-		if (offset > 0) {
-			blockdata += offset;
-			memcpy(data+bytesread,blockdata,BLOCK_SIZE-offset);
-			bytesread += BLOCK_SIZE-offset;
-			length -= BLOCK_SIZE-offset;
-			offset = 0;
-		} 
-		// full block read
-		else if (length > BLOCK_SIZE) {
-			memcpy(data+bytesread,block.data,BLOCK_SIZE);
-			bytesread += BLOCK_SIZE;
-			length -= BLOCK_SIZE;
-		} 
-		// partial block read at end
-		else {
-			memcpy(data+bytesread,block.data,length);
-			bytesread += length;
-			length = 0;
-			break;
-		}
+	// a compressed file is read a cluster at a time
+	if (inode->isvalid & INODE_COMPRESSED) {
+		if (!clusterread(fs, inumber, inode, f, data, length, offset))
+			return 0;
+		readahead(fs, inumber, inode, f, offset, length);
+		if (DEBUG) printf("bytesread: %d\n",total);
+		return total;
 	}
 
-	// read indrect blocks
-	if (inode.indirect == 0) return bytesread;
+	int first_block = offset / BLOCK_SIZE;
+	int nblocks = (offset + length - 1) / BLOCK_SIZE - first_block + 1;
+
+	int *blocks = malloc(nblocks*sizeof(int));
+	if (blocks == NULL) {
+		perror("malloc failed");
+		return 0;
+	}
 
-	disk_read(thedisk,inode.indirect,block.data);
-	int *pointers = block.pointers;
+	// gather the data blocks; anything never allocated reads as zeros
+	filemap(fs, f, inode, first_block, nblocks, blocks);
 
-	for (int i=0; i<POINTERS_PER_BLOCK; i++) {
+	// a mapped disk is copied straight into the caller's buffer
+	if (fs->diskmapped) {
+		mapcopy(fs, blocks, nblocks, offset, data, length, 0);
+		free(blocks);
+		readahead(fs, inumber, inode, f, offset, length);
+		if (DEBUG) printf("bytesread: %d\n",total);
+		return total;
+	}
 
-		if (pointers[i] == 0)
-			continue;
+	// whole blocks are read straight into the caller's buffer;
+	// only a partial first or last block goes through the bounce buffer
+	unsigned char **bufs = malloc(nblocks*sizeof(unsigned char *));
+	unsigned char *bounce = aligned_alloc(BLOCK_SIZE,2*BLOCK_SIZE);
+	if (bufs == NULL || bounce == NULL) {
+		perror("malloc failed");
+		free(blocks);
+		free(bufs);
+		free(bounce);
+		return 0;
+	}
 
-		if (offset > BLOCK_SIZE) {
-			offset -= BLOCK_SIZE;
-			continue;
+	unsigned char *partial_dst[2];
+	unsigned char *partial_src[2];
+	int partial_len[2];
+	int npartial = 0;
+
+	int n = 0;
+	int pos = offset % BLOCK_SIZE;
+	int done = 0;
+	for (int i=0; i < nblocks; i++) {
+		int len = MIN(length - done, BLOCK_SIZE - pos);
+
+		if (blocks[i] == 0) {
+			memset(data + done, 0, len);
+		} else if (len == BLOCK_SIZE) {
+			blocks[n] = blocks[i];
+			bufs[n++] = data + done;
+		} else {
+			unsigned char *slot = bounce + npartial*BLOCK_SIZE;
+			partial_dst[npartial] = data + done;
+			partial_src[npartial] = slot + pos;
+			partial_len[npartial] = len;
+			npartial++;
+			blocks[n] = blocks[i];
+			bufs[n++] = slot;
 		}
 
-		union fs_block b;
-		disk_read(thedisk, pointers[i], b.data);
-		unsigned char *blockdata = b.data;
-
-		// partial block read at beginning
-		if (offset > 0) {
-			blockdata += offset;
-			memcpy(data+bytesread,blockdata,BLOCK_SIZE-offset);
-			bytesread += BLOCK_SIZE-offset;
-			length -= BLOCK_SIZE-offset;
-			offset = 0;
-		} 
-		// full block read
-		else if (length > BLOCK_SIZE) {
-			memcpy(data+bytesread,blockdata,BLOCK_SIZE);
-			bytesread += BLOCK_SIZE;
-			length -= BLOCK_SIZE;
-		} 
-		// partial block read at end
-		else {
-			memcpy(data+bytesread,blockdata,length);
-			bytesread += length;
-			length = 0;
-			break;
-		}
+		done += len;
+		pos = 0;
+	}
+
+	// read data with one vectored request; a read continuing a stream
+	// counts its blocks as readahead hits or misses
+	struct readahead *ra = &fs->rastate[inumber % RA_SLOTS];
+	int missed = cache_readv(fs->cache, blocks, bufs, n);
+	pthread_mutex_lock(&fs->lock);
+	if (ra->inumber == inumber && ra->next == offset && offset > 0) {
+		fs->ra_hits += n - missed;
+		fs->ra_misses += missed;
 	}
+	pthread_mutex_unlock(&fs->lock);
+	for (int i=0; i < npartial; i++)
+		memcpy(partial_dst[i], partial_src[i], partial_len[i]);
+
+	free(blocks);
+	free(bufs);
+	free(bounce);
 
-	printf("bytesread: %d\n",bytesread);
-	return bytesread;
+	readahead(fs, inumber, inode, f, offset, length);
+
+	if (DEBUG) printf("bytesread: %d\n",total);
+	return total;
 }
 
-int fs_write( int inumber, const unsigned char *data, int length, int offset )
+int fs_write( struct fs *fs, int inumber, const unsigned char *data, int length, int offset )
 {
 
-	if (mounted == (1==0)) {
+	if (fs->mounted == (1==0)) {
 		printf("Not mounted\n");
 		return 0;
 	}
 
-	// read super block
-	union fs_block block;
-	disk_read(thedisk,0,block.data);
+	// check if inumber is valid
+	lockinode(fs, inumber, 1);
+	struct fs_inode *inode = validinode(fs, inumber);
+	int result = inode != NULL ? journaledwrite(fs, inumber, inode, NULL, data, length, offset) : 0;
+	unlockinode(fs, inumber);
+	if (result > 0)
+		syncpoint(fs);
+
+	return result;
+}
 
-	struct fs_superblock superblock = block.super;
+// writefile as one operation. Space that deletes have freed only comes back at a checkpoint,
+// so a write that finds none commits and checkpoints, then tries once more.
+// The caller holds the inode lock for writing.
+static int journaledwrite( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, const unsigned char *data, int length, int offset )
+{
+	beginop(fs);
+	int result = writefile(fs, inumber, inode, f, data, length, offset);
+	endop(fs);
+
+	if (result == 0 && length > 0 && freeing(fs)) {
+		commit(fs);
+		checkpoint(fs);
+		beginop(fs);
+		result = writefile(fs, inumber, inode, f, data, length, offset);
+		endop(fs);
+	}
 
-	int ninodes = superblock.ninodes;
+	return result;
+}
 
-	if (inumber < 1 || inumber > ninodes) {
-		printf("Invalid inumber\n");
+// move the contents of an inline file to blocks, written like any other data.
+// Returns 0, with the file left inline, if there is no room for them
+static int uninline( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f )
+{
+	int size = inode->size;
+	unsigned char *copy = malloc(MAX(size, 1));
+	if (copy == NULL) {
+		perror("malloc failed");
 		return 0;
 	}
 
-	// read inode block
-	int inodeblock = inumber/INODES_PER_BLOCK + 1;
-	int inodeindex = inumber%INODES_PER_BLOCK;
+	// the bytes give way to an empty block map
+	memcpy(copy, inlinedata(inode), size);
+	memset(inlinedata(inode), 0, fs->inlinemax);
+	inode->isvalid &= ~INODE_INLINE;
+	inode->size = 0;
+	dirtyinode(fs, inumber);
+
+	int ok = size == 0 || writefile(fs, inumber, inode, f, copy, size, 0) == size;
+	if (!ok) {
+		memcpy(inlinedata(inode), copy, size);
+		inode->isvalid |= INODE_INLINE;
+		inode->size = size;
+	}
 
-	disk_read(thedisk,inodeblock,block.data);
-	struct fs_inode inode = block.inode[inodeindex];
+	free(copy);
+	return ok;
+}
 
-	if (offset < 0 || offset > inode.size) {
+// write length bytes at offset of a valid inode, through handle f if it is not NULL
+static int writefile( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, const unsigned char *data, int length, int offset )
+{
+	if (offset < 0 || offset > filesize(fs, inumber, inode)) {
 		printf("Invalid offset\n");
 		return 0;
 	}
 
-	// check if inode is valid
-	if (inode.isvalid == 0) {
-		printf("Inode not valid\n");
+	// a file cannot grow past the blocks its map can reach
+	int maxsize = EXTENTS(fs) ? MAX_EXTENT_FILE_SIZE : MAX_FILE_SIZE;
+	if (length > maxsize - offset) {
+		printf("All pointers used\n");
+		length = maxsize - offset;
+	}
+
+	if (length <= 0)
 		return 0;
+
+	// a small file stays in its inode, and one that outgrows it moves to a block first
+	if (inode->isvalid & INODE_INLINE) {
+		if (offset + length <= fs->inlinemax) {
+			memcpy(inlinedata(inode) + offset, data, length);
+			if (offset + length > (int)inode->size)
+				inode->size = offset + length;
+			dirtyinode(fs, inumber);
+			syncinodes(fs);
+			return length;
+		}
+		if (!uninline(fs, inumber, inode, f))
+			return 0;
 	}
 
-	int nfree = nfreeblocks();
+	if (fs->delalloc)
+		return delaywrite(fs, inumber, inode, f, data, length, offset);
+
+	return writeblocks(fs, inumber, inode, f, data, length, offset, NULL);
+}
 
-	if(length > BLOCK_SIZE * nfree){
-		printf("Not enough free blocks\n");
+// write length bytes at offset, which is at most the size of the inode, allocating
+// blocks for whatever the file does not have yet; returns the bytes written.
+// Blocks it maps are noted in the block map of handle f, if there is one.
+// New blocks come out of the *held blocks the caller has reserved, if held is not NULL,
+// before any more are reserved.
+static int writeblocks( struct fs *fs, int inumber, struct fs_inode *inode, struct openfile *f, const unsigned char *data, int length, int offset, int *held )
+{
+	// a compressed file is written a cluster at a time
+	if (inode->isvalid & INODE_COMPRESSED)
+		return clusterwrite(fs, inumber, inode, data, length, offset, held);
+
+	int first_block = offset / BLOCK_SIZE;
+	int last_block = (offset + length - 1) / BLOCK_SIZE;
+	int nblocks = last_block - first_block + 1;
+
+	// whole blocks are written straight from the caller's buffer;
+	// only a partial first or last block is staged, and a mapped disk needs no staging at all
+	int *blocks = malloc(nblocks*sizeof(int));
+	unsigned char *fresh = calloc(nblocks,1);
+	unsigned char **bufs = malloc(nblocks*sizeof(unsigned char *));
+	unsigned char *bounce = fs->diskmapped ? NULL : aligned_alloc(BLOCK_SIZE,2*BLOCK_SIZE);
+	if (blocks == NULL || fresh == NULL || bufs == NULL || (bounce == NULL && !fs->diskmapped)) {
+		perror("malloc failed");
+		free(blocks);
+		free(fresh);
+		free(bufs);
+		free(bounce);
 		return 0;
 	}
 
-	int data_block_index = offset / BLOCK_SIZE;
-	int data_offset = offset % BLOCK_SIZE;
+	// map every block of the request, allocating the ones it adds;
+	// an overwrite of blocks a handle has mapped needs no metadata at all
+	int mapped;
+	if (f != NULL && first_block + nblocks <= f->nmapped) {
+		memcpy(blocks, f->map + first_block, nblocks*sizeof(int));
+		mapped = nblocks;
+	} else {
+		mapped = EXTENTS(fs) ? extentwrite(fs, inode, first_block, nblocks, blocks, fresh, held)
+		                 : pointerwrite(fs, inode, first_block, nblocks, blocks, fresh, held);
+		if (f != NULL && mapped > 0)
+			recordmap(f, first_block, mapped, blocks);
+	}
+	if (mapped < nblocks) {
+		nblocks = mapped;
+		length = MIN(length, nblocks*BLOCK_SIZE - offset % BLOCK_SIZE);
+	}
+	if (nblocks <= 0) {
+		free(blocks);
+		free(fresh);
+		free(bufs);
+		free(bounce);
+		return 0;
+	}
 
-	int new_size = offset + length;
-	block.inode[inodeindex].size = new_size;
-	disk_write(thedisk, inodeblock, block.data);
-	disk_read(thedisk,inodeblock,block.data);
+	// partial blocks that already hold data are read before being overwritten
+	int rmw_blocks[2];
+	unsigned char *rmw_bufs[2];
+	int nrmw = 0;
+
+	unsigned char *partial_dst[2];
+	const unsigned char *partial_src[2];
+	int partial_len[2];
+	int npartial = 0;
+
+	int pos = offset % BLOCK_SIZE;
+	int done = 0;
+
+	for (int i = 0; i < nblocks; i++) {
+		int len = MIN(length - done, BLOCK_SIZE - pos);
+
+		if (fs->diskmapped) {
+			// the part of a new block that is not written reads as zeros
+			if (fresh[i] && len < BLOCK_SIZE) memset(disk_block_ptr(fs->disk,blocks[i]), 0, BLOCK_SIZE);
+		} else if (len == BLOCK_SIZE) {
+			bufs[i] = (unsigned char *)data + done;
+		} else {
+			unsigned char *slot = bounce + npartial*BLOCK_SIZE;
+			if (fresh[i]) {
+				memset(slot, 0, BLOCK_SIZE);
+			} else {
+				rmw_blocks[nrmw] = blocks[i];
+				rmw_bufs[nrmw++] = slot;
+			}
+			partial_dst[npartial] = slot + pos;
+			partial_src[npartial] = data + done;
+			partial_len[npartial] = len;
+			npartial++;
+			bufs[i] = slot;
+		}
 
-	int nwrite = 0;
-	int ncopy = 0;
+		done += len;
+		pos = 0;
+	}
 
-	while(nwrite < length){
-		union fs_block data_block = {{0}};
-		union fs_block indirblock = {{0}};
+	if (fs->diskmapped) {
+		// a mapped disk takes the new bytes in place
+		mapcopy(fs, blocks, nblocks, offset, (unsigned char *)data, length, 1);
+	} else {
+		// read only the partial blocks that have old contents, then write the batch once
+		cache_readv(fs->cache, rmw_blocks, rmw_bufs, nrmw);
+		for (int i = 0; i < npartial; i++)
+			memcpy(partial_dst[i], partial_src[i], partial_len[i]);
+		cache_writev(fs->cache, blocks, (const unsigned char **)bufs, nblocks);
+	}
 
-		int selected_block = 0;
-		int new_block_needed = 0;
+	free(blocks);
+	free(fresh);
+	free(bufs);
+	free(bounce);
 
-		if(data_block_index < POINTERS_PER_INODE){
-			if(inode.direct[data_block_index] == 0){
-				if((selected_block = getfreeblock()) == -1){
-					return 0;
-				}
+	if(offset + length > inode->size){
+		inode->size = offset + length;
+	}
+	dirtyinode(fs, inumber);
+	syncinodes(fs);
 
-				block.inode[inodeindex].direct[data_block_index] = selected_block;
-				markused(selected_block);
-				disk_write(thedisk, inodeblock, block.data);
-				disk_read(thedisk,inodeblock,block.data);
-			}
+	return length;
+}
 
-			if(block.inode[inodeindex].direct[data_block_index] < superblock.nblocks){
-				if(length - nwrite < BLOCK_SIZE - data_offset){
-					ncopy = length - nwrite;
-				}
-				else{
-					ncopy = BLOCK_SIZE - data_offset;
-					new_block_needed = 1;
-				}
+// the handle fd, with the lock of its file taken for reading or writing,
+// or NULL if it is not open or its file has been deleted
+static struct openfile *openhandle( struct fs *fs, int fd, int write )
+{
+	if (fs->mounted == (1==0)) {
+		printf("Not mounted\n");
+		return NULL;
+	}
 
-				disk_read(thedisk, block.inode[inodeindex].direct[data_block_index], data_block.data);
-				memcpy(data_block.data + data_offset, data + nwrite, ncopy);
-				disk_write(thedisk, block.inode[inodeindex].direct[data_block_index], data_block.data);
-			}
-			else return 0;
+	pthread_mutex_lock(&fs->lock);
+	int inumber = fd >= 0 && fd < OPEN_FILES && fs->openfiles[fd].inuse ? fs->openfiles[fd].inumber : -1;
+	pthread_mutex_unlock(&fs->lock);
+
+	if (inumber < 0) {
+		printf("Invalid file handle\n");
+		return NULL;
+	}
+
+	// the file may be deleted while its lock is awaited
+	if (inumber != 0) {
+		lockinode(fs, inumber, write);
+		if (fs->openfiles[fd].inumber != inumber) {
+			unlockinode(fs, inumber);
+			inumber = 0;
 		}
-		else{
-			int indirect_offset = data_block_index - POINTERS_PER_INODE;
+	}
 
-			if(indirect_offset >= POINTERS_PER_BLOCK){
-				printf("All pointers used\n");
-				return nwrite;
-			}
+	if (inumber == 0) {
+		printf("File was deleted\n");
+		return NULL;
+	}
 
-			if(inode.indirect == 0){
-				if((selected_block = getfreeblock()) == -1){
-					return 0;
-				}
-				block.inode[inodeindex].indirect = selected_block;
-				markused(selected_block);
-				disk_write(thedisk, inodeblock, block.data);
-				disk_read(thedisk,inodeblock,block.data);
-			}
-			else{
-				if(inode.indirect < superblock.nblocks){
-					disk_read(thedisk, block.inode[inodeindex].indirect, indirblock.data);
-				}
-				else return 0;
-			}
+	return &fs->openfiles[fd];
+}
 
-			if(indirblock.pointers[indirect_offset] == 0){
-				if((selected_block = getfreeblock()) == -1){
-					return 0;
-				}
-				if(selected_block < superblock.nblocks){
-					indirblock.pointers[indirect_offset] = selected_block;
-					markused(selected_block);
-					disk_write(thedisk, block.inode[inodeindex].indirect, indirblock.data);
-				}
-			}
-			else{
-				if(indirblock.pointers[indirect_offset] < superblock.nblocks){
-					disk_read(thedisk, indirblock.pointers[indirect_offset], data_block.data);
-				}
-			}
+int fs_open( struct fs *fs, int inumber )
+{
+	if (fs->mounted == (1==0)) {
+		printf("Not mounted\n");
+		return -1;
+	}
 
-			if(indirblock.pointers[indirect_offset] < superblock.nblocks){
-				if(length - nwrite < BLOCK_SIZE - data_offset){
-					ncopy = length - nwrite;
-				}
-				else{
-					ncopy = BLOCK_SIZE - data_offset;
-					new_block_needed = 1;
-				}
+	lockinode(fs, inumber, 0);
+	struct fs_inode *inode = validinode(fs, inumber);
+	if (inode == NULL) {
+		unlockinode(fs, inumber);
+		return -1;
+	}
 
-				disk_read(thedisk, indirblock.pointers[indirect_offset], data_block.data);
-				memcpy(data_block.data + data_offset, data + nwrite, ncopy);
-				disk_write(thedisk, indirblock.pointers[indirect_offset], data_block.data);
-			}
-		}
+	pthread_mutex_lock(&fs->lock);
+	int fd;
+	for (fd = 0; fd < OPEN_FILES; fd++)
+		if (!fs->openfiles[fd].inuse) break;
+	if (fd < OPEN_FILES) {
+		fs->openfiles[fd].inuse = 1;
+		fs->openfiles[fd].inumber = inumber;
+	}
+	pthread_mutex_unlock(&fs->lock);
 
-		nwrite += ncopy;
-		if(new_block_needed) {
-			data_block_index++;
-			data_offset = 0;
-		}
-		else{
-			data_offset += ncopy;
-		}
+	if (fd == OPEN_FILES) {
+		unlockinode(fs, inumber);
+		printf("Too many open files\n");
+		return -1;
+	}
+
+	// map the whole file now, so I/O through the handle finds every block it has
+	struct openfile *f = &fs->openfiles[fd];
+	int ok = extendmap(fs, f, inode);
+	unlockinode(fs, inumber);
+	if (!ok) {
+		fs_close(fs, fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int fs_close( struct fs *fs, int fd )
+{
+	pthread_mutex_lock(&fs->lock);
+	int ok = fd >= 0 && fd < OPEN_FILES && fs->openfiles[fd].inuse;
+	if (ok) {
+		free(fs->openfiles[fd].map);
+		free(fs->openfiles[fd].plain);
+		memset(&fs->openfiles[fd], 0, sizeof(fs->openfiles[fd]));
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	if (!ok)
+		printf("Invalid file handle\n");
+
+	return ok;
+}
 
+int fs_seek( struct fs *fs, int fd, int offset )
+{
+	struct openfile *f = openhandle(fs, fd, 0);
+	if (f == NULL)
+		return -1;
+
+	int inumber = f->inumber;
+	if (offset < 0 || offset > filesize(fs, inumber, getinode(fs, inumber))) {
+		printf("Invalid offset\n");
+		offset = -1;
+	} else {
+		f->pos = offset;
 	}
+	unlockinode(fs, inumber);
+
+	return offset;
+}
+
+int fs_fread( struct fs *fs, int fd, unsigned char *data, int length )
+{
+	struct openfile *f = openhandle(fs, fd, 0);
+	if (f == NULL)
+		return 0;
+
+	// pick up blocks allocated since the handle last looked, such as by fs_write or a flush
+	int inumber = f->inumber;
+	struct fs_inode *inode = getinode(fs, inumber);
+	int result = 0;
+	if (extendmap(fs, f, inode))
+		result = readfile(fs, inumber, inode, f, data, length, f->pos);
+	f->pos += result;
+	unlockinode(fs, inumber);
+
+	return result;
+}
 
-	return nwrite;
-}
\ No newline at end of file
+int fs_fwrite( struct fs *fs, int fd, const unsigned char *data, int length )
+{
+	struct openfile *f = openhandle(fs, fd, 1);
+	if (f == NULL)
+		return 0;
+
+	int inumber = f->inumber;
+	struct fs_inode *inode = getinode(fs, inumber);
+	int result = 0;
+	if (extendmap(fs, f, inode))
+		result = journaledwrite(fs, inumber, inode, f, data, length, f->pos);
+	f->pos += result;
+	unlockinode(fs, inumber);
+	if (result > 0)
+		syncpoint(fs);
+
+	return result;
+}
@@ -1,15 +1,97 @@
 #ifndef FS_H
 #define FS_H
 
-int  fs_format();
-void fs_debug();
-int  fs_mount();
+/*
+Files on a new filesystem are mapped either by direct and indirect block pointers,
+as in SimpleFS, or by extents: runs of consecutive blocks, kept in the inode
+and moved to an extent tree when a file has more than fit there.
+FS_LAYOUT_COMPRESSED maps files by block pointers and compresses every new file.
+*/
 
-int  fs_create();
-int  fs_delete( int inumber );
-int  fs_getsize();
+#define FS_LAYOUT_BLOCKMAP   0
+#define FS_LAYOUT_EXTENTS    1
+#define FS_LAYOUT_COMPRESSED 2
 
-int  fs_read( int inumber,  unsigned char *data, int length, int offset );
-int  fs_write( int inumber, const unsigned  char *data, int length, int offset );
+/*
+The blocks of a compressed file are written in clusters of 32 KB, each compressed
+with a small built-in LZ codec into as few blocks as it fits in, and stored as it is
+when that saves nothing. Reading a file that compresses well moves fewer blocks.
+fs_setcompress turns compression on or off for one block-mapped file
+before it has any data blocks.
+*/
+
+/*
+An inode takes FS_INODE_SIZE bytes unless fs_format_inodes gives every inode a bigger slot,
+a power of two up to the block size; fewer inodes then fit in the same inode blocks.
+A file small enough to fit in its slot keeps its contents there, in place of its block map,
+so that it costs no data block and reading it no disk I/O, since the inode table is resident;
+once it grows past that it moves to blocks for good.
+*/
+
+#define FS_INODE_SIZE 32
+
+struct disk;
+
+/*
+fs_sync writes every change made so far to the disk and waits until it is on stable storage;
+fs_flush writes it but need not wait. fs_setsync chooses, before mounting, when that also happens by itself:
+FS_SYNC_NONE leaves it to fs_sync and unmount, FS_SYNC_PERIODIC has a background thread
+sync every "interval" milliseconds, or sooner once "dirty" blocks are waiting in memory,
+and FS_SYNC_STRICT syncs before every call that changes the filesystem returns.
+fs_sync, fs_flush and fs_unmount return 0 if buffered data could not be written;
+fs_sync and fs_flush keep it for the next try, while fs_unmount drops it.
+*/
+
+#define FS_SYNC_NONE     0
+#define FS_SYNC_PERIODIC 1
+#define FS_SYNC_STRICT   2
+
+/*
+Every call takes the filesystem it works on, created by fs_init on an open disk
+and released by fs_destroy, which unmounts it first if need be.
+Once mounted, a filesystem can be used from many threads at once: calls on different
+files run in parallel, and reads of one file share it while a write has it alone.
+fs_format, fs_mount, fs_unmount and the settings calls must not overlap any other call,
+and a file handle belongs to one thread at a time.
+*/
+
+struct fs * fs_init( struct disk *d );
+void fs_destroy( struct fs *fs );
+
+int  fs_format( struct fs *fs );
+int  fs_format_layout( struct fs *fs, int layout );
+int  fs_format_inodes( struct fs *fs, int layout, int inodesize );
+void fs_debug( struct fs *fs );
+int  fs_mount( struct fs *fs );
+int  fs_unmount( struct fs *fs );
+int  fs_setcache( struct fs *fs, int capacity, int policy );
+int  fs_setdelalloc( struct fs *fs, int on );
+int  fs_setsync( struct fs *fs, int mode, int interval, int dirty );
+int  fs_flush( struct fs *fs );
+int  fs_sync( struct fs *fs );
+void fs_stats( struct fs *fs );
+
+int  fs_create( struct fs *fs );
+int  fs_delete( struct fs *fs, int inumber );
+int  fs_create_many( struct fs *fs, int n, int *inumbers );
+int  fs_delete_many( struct fs *fs, const int *inumbers, int n );
+int  fs_getsize( struct fs *fs, int inumber );
+int  fs_setcompress( struct fs *fs, int inumber, int on );
+
+int  fs_read( struct fs *fs, int inumber, unsigned char *data, int length, int offset );
+int  fs_write( struct fs *fs, int inumber, const unsigned char *data, int length, int offset );
+
+/*
+An open file is named by a small handle that keeps the block map of the file
+and a position, which reads and writes through the handle start at and advance.
+fs_open returns the handle, or -1 on failure; fs_seek returns the new position, or -1.
+Handles are dropped at unmount, and one whose file is deleted can only be closed.
+*/
+
+int  fs_open( struct fs *fs, int inumber );
+int  fs_close( struct fs *fs, int fd );
+int  fs_seek( struct fs *fs, int fd, int offset );
+int  fs_fread( struct fs *fs, int fd, unsigned char *data, int length );
+int  fs_fwrite( struct fs *fs, int fd, const unsigned char *data, int length );
 
 #endif
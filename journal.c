@@ -0,0 +1,542 @@
+/*
+Write-ahead metadata journal.
+Block 0 of the region is a header naming where the oldest transaction not yet
+checkpointed starts and the sequence number it has; the rest is the log.
+A transaction is a descriptor listing the home blocks, the blocks themselves,
+and a commit block with a checksum of them all, which is how replay tells a
+complete transaction from a torn one or from the leftovers of an earlier pass.
+In memory each block the journal holds has its newest contents, and the contents
+of its last commit until they are checkpointed.
+*/
+
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define JOURNAL_MAGIC    0x4a524e4c
+#define JOURNAL_DESC     0x4a444553
+#define JOURNAL_COMMIT   0x4a434d54
+#define JOURNAL_NEEDSCAN 0x1
+#define JOURNAL_TAGS     ((BLOCK_SIZE - 16) / 4)
+#define JOURNAL_MIN      8
+#define JOURNAL_BUCKETS  1024
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t start;
+	uint32_t flags;
+};
+
+struct journal_desc {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t count;
+	uint32_t unused;
+	uint32_t tag[JOURNAL_TAGS];
+};
+
+struct journal_commit {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t count;
+	uint32_t checksum;
+};
+
+union journal_block {
+	struct journal_header header;
+	struct journal_desc desc;
+	struct journal_commit commit;
+	unsigned char data[BLOCK_SIZE];
+};
+
+struct journal_entry {
+	int block;
+	int dirty;			// changed since the last commit
+	unsigned char *live;		// newest contents
+	unsigned char *committed;	// contents at the last commit, until checkpointed
+	struct journal_entry *next;
+};
+
+struct journal {
+	struct disk *disk;
+	struct cache *cache;
+	int start;
+	int logsize;
+
+	// the next transaction's sequence number and log position, where the oldest one
+	// not yet checkpointed starts, and the header flags; positions only ever grow
+	uint32_t sequence;
+	long head;
+	long tail;
+	uint32_t flags;
+
+	// lock covers the operation count, the barrier, the log positions and the blocks held
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nops;
+	int barrier;
+	int ndirty;
+	struct journal_entry *buckets[JOURNAL_BUCKETS];
+};
+
+static uint32_t checksum( uint32_t sum, const unsigned char *data )
+{
+	// FNV-1a
+	for(int i=0; i<BLOCK_SIZE; i++) sum = (sum ^ data[i]) * 16777619u;
+	return sum;
+}
+
+static int logblock( int start, int logsize, long pos )
+{
+	return start + 1 + pos % logsize;
+}
+
+static void write_header( struct disk *d, int start, uint32_t sequence, uint32_t pos, uint32_t flags )
+{
+	union journal_block block;
+
+	memset(block.data,0,BLOCK_SIZE);
+	block.header.magic = JOURNAL_MAGIC;
+	block.header.sequence = sequence;
+	block.header.start = pos;
+	block.header.flags = flags;
+	disk_write(d,start,block.data);
+}
+
+int journal_format( struct disk *d, int start, int nblocks )
+{
+	if(nblocks<JOURNAL_MIN) return 0;
+
+	// a log left by an earlier filesystem would otherwise replay, since
+	// its sequence numbers start over at the same place as the new one's
+	unsigned char *zero = aligned_alloc(BLOCK_SIZE,BLOCK_SIZE);
+	if(!zero) return 0;
+	memset(zero,0,BLOCK_SIZE);
+	for(int i=1; i<nblocks; i++) disk_write(d,start+i,zero);
+	free(zero);
+
+	write_header(d,start,1,0,0);
+	return 1;
+}
+
+int journal_recover( struct disk *d, int start, int nblocks, int *needscan )
+{
+	union journal_block header, desc, commit;
+	int logsize = nblocks - 1;
+	int replayed = 0;
+
+	disk_read(d,start,header.data);
+	if(header.header.magic!=JOURNAL_MAGIC || nblocks<JOURNAL_MIN || header.header.start>=logsize) return -1;
+
+	unsigned char *pool = aligned_alloc(BLOCK_SIZE,(size_t)JOURNAL_TAGS*BLOCK_SIZE);
+	int *blocks = malloc(JOURNAL_TAGS*sizeof(int));
+	unsigned char **bufs = malloc(JOURNAL_TAGS*sizeof(unsigned char *));
+	if(!pool || !blocks || !bufs) {
+		fprintf(stderr,"journal_recover: out of memory\n");
+		abort();
+	}
+
+	uint32_t sequence = header.header.sequence;
+	long pos = header.header.start;
+	long used = 0;
+
+	// replay transactions in order until one is missing, torn or out of sequence
+	while(used+2<=logsize) {
+		disk_read(d,logblock(start,logsize,pos),desc.data);
+		if(desc.desc.magic!=JOURNAL_DESC || desc.desc.sequence!=sequence) break;
+
+		int n = desc.desc.count;
+		if(n>JOURNAL_TAGS || used+n+2>logsize) break;
+
+		int ok = 1;
+		for(int i=0; i<n; i++) {
+			int home = desc.desc.tag[i];
+			if(home<=0 || home>=disk_nblocks(d) || (home>=start && home<start+nblocks)) ok = 0;
+			blocks[i] = logblock(start,logsize,pos+1+i);
+			bufs[i] = pool + (size_t)i*BLOCK_SIZE;
+		}
+		if(!ok) break;
+
+		disk_readv(d,blocks,bufs,n);
+		disk_read(d,logblock(start,logsize,pos+1+n),commit.data);
+
+		uint32_t sum = checksum(2166136261u,desc.data);
+		for(int i=0; i<n; i++) sum = checksum(sum,bufs[i]);
+		if(commit.commit.magic!=JOURNAL_COMMIT || commit.commit.sequence!=sequence ||
+		   commit.commit.count!=n || commit.commit.checksum!=sum) break;
+
+		for(int i=0; i<n; i++) blocks[i] = desc.desc.tag[i];
+		disk_writev(d,blocks,(const unsigned char **)bufs,n);
+
+		pos += n + 2;
+		used += n + 2;
+		sequence++;
+		replayed++;
+	}
+
+	free(pool);
+	free(blocks);
+	free(bufs);
+
+	// the replayed blocks are durable before the log forgets them
+	disk_sync(d);
+	if(replayed>0) {
+		write_header(d,start,sequence,pos%logsize,header.header.flags);
+		disk_sync(d);
+	}
+
+	*needscan = (header.header.flags & JOURNAL_NEEDSCAN) != 0;
+	return replayed;
+}
+
+struct journal * journal_open( struct disk *d, struct cache *c, int start, int nblocks )
+{
+	union journal_block header;
+	struct journal *j;
+
+	disk_read(d,start,header.data);
+	if(header.header.magic!=JOURNAL_MAGIC || nblocks<JOURNAL_MIN || header.header.start>=nblocks-1) return 0;
+
+	j = calloc(1,sizeof(*j));
+	if(!j) return 0;
+
+	j->disk = d;
+	j->cache = c;
+	j->start = start;
+	j->logsize = nblocks - 1;
+	j->sequence = header.header.sequence;
+	j->head = j->tail = header.header.start;
+	pthread_mutex_init(&j->lock,0);
+	pthread_cond_init(&j->cond,0);
+
+	// a mount that follows an oversized transaction has checked the home blocks
+	if(header.header.flags) {
+		write_header(d,start,j->sequence,j->head,0);
+		disk_sync(d);
+	}
+
+	return j;
+}
+
+void journal_start( struct journal *j )
+{
+	pthread_mutex_lock(&j->lock);
+	while(j->barrier) pthread_cond_wait(&j->cond,&j->lock);
+	j->nops++;
+	pthread_mutex_unlock(&j->lock);
+}
+
+int journal_stop( struct journal *j, int pending )
+{
+	pthread_mutex_lock(&j->lock);
+	j->nops--;
+	if(j->nops==0 && j->barrier) pthread_cond_broadcast(&j->cond);
+	int full = j->ndirty + pending >= j->logsize/4;
+	pthread_mutex_unlock(&j->lock);
+	return full;
+}
+
+static struct journal_entry * lookup( struct journal *j, int block )
+{
+	struct journal_entry *e = j->buckets[(unsigned)block % JOURNAL_BUCKETS];
+	while(e && e->block!=block) e = e->next;
+	return e;
+}
+
+int journal_read( struct journal *j, int block, unsigned char *data )
+{
+	pthread_mutex_lock(&j->lock);
+	struct journal_entry *e = lookup(j,block);
+	if(e) memcpy(data,e->live,BLOCK_SIZE);
+	pthread_mutex_unlock(&j->lock);
+	return e!=0;
+}
+
+void journal_write( struct journal *j, int block, const unsigned char *data )
+{
+	pthread_mutex_lock(&j->lock);
+	struct journal_entry *e = lookup(j,block);
+	if(!e) {
+		e = calloc(1,sizeof(*e));
+		if(e) e->live = aligned_alloc(BLOCK_SIZE,BLOCK_SIZE);
+		if(!e || !e->live) {
+			fprintf(stderr,"journal_write: out of memory\n");
+			abort();
+		}
+		e->block = block;
+		e->next = j->buckets[(unsigned)block % JOURNAL_BUCKETS];
+		j->buckets[(unsigned)block % JOURNAL_BUCKETS] = e;
+	}
+	memcpy(e->live,data,BLOCK_SIZE);
+	if(!e->dirty) {
+		e->dirty = 1;
+		j->ndirty++;
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_barrier( struct journal *j )
+{
+	pthread_mutex_lock(&j->lock);
+	j->barrier = 1;
+	while(j->nops>0) pthread_cond_wait(&j->cond,&j->lock);
+	pthread_mutex_unlock(&j->lock);
+}
+
+// the blocks and committed contents of every entry with a committed copy;
+// returns how many there are. The caller holds the lock.
+static int committed_blocks( struct journal *j, int **blocks, const unsigned char ***data )
+{
+	int n = 0;
+
+	for(int b=0; b<JOURNAL_BUCKETS; b++) {
+		for(struct journal_entry *e=j->buckets[b]; e; e=e->next) n += e->committed!=0;
+	}
+
+	*blocks = malloc((n>0 ? n : 1)*sizeof(int));
+	*data = malloc((n>0 ? n : 1)*sizeof(unsigned char *));
+	if(!*blocks || !*data) {
+		fprintf(stderr,"journal: out of memory\n");
+		abort();
+	}
+
+	n = 0;
+	for(int b=0; b<JOURNAL_BUCKETS; b++) {
+		for(struct journal_entry *e=j->buckets[b]; e; e=e->next) {
+			if(!e->committed) continue;
+			(*blocks)[n] = e->block;
+			(*data)[n] = e->committed;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+// drop the committed copies once they are home, and every entry no newer than its home block
+static void forget_committed( struct journal *j )
+{
+	pthread_mutex_lock(&j->lock);
+	for(int b=0; b<JOURNAL_BUCKETS; b++) {
+		struct journal_entry **p = &j->buckets[b];
+		while(*p) {
+			struct journal_entry *e = *p;
+			free(e->committed);
+			e->committed = 0;
+			if(e->dirty) {
+				p = &e->next;
+				continue;
+			}
+			*p = e->next;
+			free(e->live);
+			free(e);
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+int journal_checkpoint( struct journal *j )
+{
+	int *blocks;
+	const unsigned char **data;
+
+	pthread_mutex_lock(&j->lock);
+	int n = committed_blocks(j,&blocks,&data);
+	long head = j->head;
+	uint32_t sequence = j->sequence;
+	int empty = j->tail==head;
+	pthread_mutex_unlock(&j->lock);
+
+	// home blocks go through the cache, so that cached copies stay current
+	cache_writev(j->cache,blocks,data,n);
+	int ok = disk_sync(j->disk);
+	free(blocks);
+	free(data);
+
+	// every transaction written in place is home by now, so the next mount
+	// has nothing to check and the mark comes off with the new header
+	if(ok && (!empty || j->flags)) {
+		write_header(j->disk,j->start,sequence,head%j->logsize,0);
+		ok = disk_sync(j->disk);
+	}
+	if(!ok) return 0;
+	j->flags = 0;
+
+	forget_committed(j);
+
+	pthread_mutex_lock(&j->lock);
+	j->tail = head;
+	pthread_mutex_unlock(&j->lock);
+
+	return 1;
+}
+
+// write a transaction too big for the log straight to its home blocks, after marking
+// the journal so that the next mount checks them
+static int commit_in_place( struct journal *j, int *blocks, const unsigned char **data, int n )
+{
+	j->flags |= JOURNAL_NEEDSCAN;
+	write_header(j->disk,j->start,j->sequence,j->head%j->logsize,j->flags);
+	if(!disk_sync(j->disk)) return 0;
+
+	cache_writev(j->cache,blocks,data,n);
+	if(!disk_sync(j->disk)) return 0;
+
+	forget_committed(j);
+	return 1;
+}
+
+int journal_commit( struct journal *j )
+{
+	union journal_block *desc = aligned_alloc(BLOCK_SIZE,2*BLOCK_SIZE);
+	union journal_block *commit = desc + 1;
+	int *blocks;
+	const unsigned char **data;
+	int ok = 1;
+
+	if(!desc) {
+		fprintf(stderr,"journal_commit: out of memory\n");
+		abort();
+	}
+
+	pthread_mutex_lock(&j->lock);
+	int n = j->ndirty;
+	int fits = n<=JOURNAL_TAGS && n+2<=j->logsize;
+	pthread_mutex_unlock(&j->lock);
+
+	// make room while operations are still held off, so that no block of this
+	// transaction can be checkpointed before it is in the log
+	if(n>0 && (!fits || n+2>j->logsize-journal_used(j))) ok = journal_checkpoint(j);
+
+	// take the transaction: its blocks become the committed copies.
+	// If the log could not be emptied it stays running, to be committed later
+	pthread_mutex_lock(&j->lock);
+	if(!ok) {
+		j->barrier = 0;
+		pthread_cond_broadcast(&j->cond);
+		pthread_mutex_unlock(&j->lock);
+		free(desc);
+		return 0;
+	}
+	blocks = malloc((n+2)*sizeof(int));
+	data = malloc((n+2)*sizeof(unsigned char *));
+	if(!blocks || !data) {
+		fprintf(stderr,"journal_commit: out of memory\n");
+		abort();
+	}
+	int k = 0;
+	for(int b=0; b<JOURNAL_BUCKETS && k<n; b++) {
+		for(struct journal_entry *e=j->buckets[b]; e; e=e->next) {
+			if(!e->dirty) continue;
+			if(!e->committed) e->committed = aligned_alloc(BLOCK_SIZE,BLOCK_SIZE);
+			if(!e->committed) {
+				fprintf(stderr,"journal_commit: out of memory\n");
+				abort();
+			}
+			memcpy(e->committed,e->live,BLOCK_SIZE);
+			e->dirty = 0;
+			blocks[k] = e->block;
+			data[k] = e->committed;
+			k++;
+		}
+	}
+	j->ndirty = 0;
+	j->barrier = 0;
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+
+	if(n==0) {
+		free(desc);
+		free(blocks);
+		free(data);
+		return 1;
+	}
+
+	// ordered: the data the metadata points to is durable first
+	cache_flush(j->cache);
+	ok = disk_sync(j->disk);
+
+	if(ok && !fits) {
+		ok = commit_in_place(j,blocks,data,n);
+	} else if(ok) {
+		memset(desc,0,2*BLOCK_SIZE);
+		desc->desc.magic = JOURNAL_DESC;
+		desc->desc.sequence = j->sequence;
+		desc->desc.count = n;
+		for(int i=0; i<n; i++) desc->desc.tag[i] = blocks[i];
+
+		uint32_t sum = checksum(2166136261u,desc->data);
+		for(int i=0; i<n; i++) sum = checksum(sum,data[i]);
+		commit->commit.magic = JOURNAL_COMMIT;
+		commit->commit.sequence = j->sequence;
+		commit->commit.count = n;
+		commit->commit.checksum = sum;
+
+		// the descriptor, the blocks and the commit block go out as one batch;
+		// the checksum catches a commit block that landed without the rest
+		for(int i=n; i>0; i--) {
+			blocks[i] = blocks[i-1];
+			data[i] = data[i-1];
+		}
+		blocks[0] = logblock(j->start,j->logsize,j->head);
+		data[0] = desc->data;
+		for(int i=1; i<=n; i++) blocks[i] = logblock(j->start,j->logsize,j->head+i);
+		blocks[n+1] = logblock(j->start,j->logsize,j->head+n+1);
+		data[n+1] = commit->data;
+		disk_writev(j->disk,blocks,data,n+2);
+		ok = disk_sync(j->disk);
+	}
+
+	if(ok) {
+		pthread_mutex_lock(&j->lock);
+		// an in-place transaction leaves nothing in the log, so its sequence
+		// number goes to the next one, which the header already expects
+		if(fits) {
+			j->head += n + 2;
+			j->sequence++;
+		} else {
+			j->tail = j->head;
+		}
+		pthread_mutex_unlock(&j->lock);
+	}
+
+	free(desc);
+	free(blocks);
+	free(data);
+	return ok;
+}
+
+int journal_used( struct journal *j )
+{
+	pthread_mutex_lock(&j->lock);
+	int used = j->head - j->tail;
+	pthread_mutex_unlock(&j->lock);
+	return used;
+}
+
+int journal_size( struct journal *j )
+{
+	return j->logsize;
+}
+
+void journal_close( struct journal *j )
+{
+	if(!j) return;
+	for(int b=0; b<JOURNAL_BUCKETS; b++) {
+		while(j->buckets[b]) {
+			struct journal_entry *e = j->buckets[b];
+			j->buckets[b] = e->next;
+			free(e->live);
+			free(e->committed);
+			free(e);
+		}
+	}
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+	free(j);
+}
@@ -0,0 +1,106 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "disk.h"
+#include "cache.h"
+
+/*
+A write-ahead journal of metadata blocks, kept in a circular log on the disk.
+Operations change metadata between journal_start and journal_stop, and the blocks
+they write collect in the running transaction, in memory.
+A commit waits for the operations in progress to finish, then writes the transaction
+to the log behind a descriptor block and ahead of a commit block, so a whole batch
+of operations shares one sync. Until a checkpoint copies them to their home
+locations, committed blocks stay in memory and their log space stays in use.
+After a crash, journal_recover replays the committed transactions left in the log,
+in time that depends on the size of the log and not of the disk.
+*/
+
+/*
+Write an empty journal to blocks start..start+nblocks-1 of the disk, clearing
+any log an earlier filesystem left there.
+Returns 1 on success, or 0 if the region is too small to hold a journal.
+*/
+
+int journal_format( struct disk *d, int start, int nblocks );
+
+/*
+Copy every committed transaction left in the journal at blocks start..start+nblocks-1
+to its home blocks, make them durable, and empty the log.
+*needscan is set if a transaction too big for the log was written in place since the
+journal was opened, so that a crash may have left the home blocks inconsistent.
+Returns the number of transactions replayed, or -1 if there is no journal there.
+*/
+
+int journal_recover( struct disk *d, int start, int nblocks, int *needscan );
+
+/*
+Open a recovered journal. Checkpoints write home blocks through cache "c".
+Returns a pointer to a new journal object, or null on failure.
+*/
+
+struct journal * journal_open( struct disk *d, struct cache *c, int start, int nblocks );
+
+/*
+Begin and end an operation that changes metadata. A commit never sees an operation
+half done. journal_stop returns 1 when the running transaction, together with the
+"pending" blocks the caller keeps elsewhere and will add at commit, has grown big enough
+that it should be committed; the caller must not be inside an operation to do so.
+*/
+
+void journal_start( struct journal *j );
+int  journal_stop( struct journal *j, int pending );
+
+/*
+Copy the newest contents of a block the journal holds into "data".
+Returns 1 if the journal holds the block, or 0 if its home location is current.
+*/
+
+int journal_read( struct journal *j, int block, unsigned char *data );
+
+/*
+Add the new contents of a metadata block to the running transaction.
+Nothing is written to the block's home location before the transaction is committed.
+*/
+
+void journal_write( struct journal *j, int block, const unsigned char *data );
+
+/*
+Commit the running transaction in two steps. journal_barrier waits for the operations
+in progress and holds off new ones, so the caller can add blocks it keeps elsewhere
+with journal_write. journal_commit takes the transaction, lets operations continue,
+and writes it: first every dirty block of the cache is flushed, so that data reaches
+the disk before the metadata pointing at it, then the log is written and synced.
+The log is checkpointed first if the transaction does not fit in what is left of it;
+a transaction bigger than the whole log is written in place instead, and the journal
+is marked so that the next mount does not trust the home blocks.
+Returns 1 on success.
+Commits and checkpoints must not run at the same time; the caller serializes them.
+*/
+
+void journal_barrier( struct journal *j );
+int  journal_commit( struct journal *j );
+
+/*
+Write every committed block to its home location and make it durable, then free
+the log space of every committed transaction, and clear the mark left by a transaction
+written in place. Returns 1 on success.
+*/
+
+int journal_checkpoint( struct journal *j );
+
+/*
+Return the number of log blocks holding transactions not yet checkpointed,
+and the number of blocks the log has in all.
+*/
+
+int journal_used( struct journal *j );
+int journal_size( struct journal *j );
+
+/*
+Release the journal. Anything not yet committed is lost.
+*/
+
+void journal_close( struct journal *j );
+
+#endif
@@ -0,0 +1,152 @@
+/*
+Greedy LZ77 with a single-probe hash table of recent 4-byte strings.
+*/
+
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH  4
+#define MAX_OFFSET 65535
+#define HASH_BITS  12
+
+// literals and matches of 15 or more continue in bytes after the token
+#define MORE 15
+
+// the decoder copies in words of this many bytes while it is that far from the ends of
+// its buffers, which may write past the end of a copy; whatever a later copy does not
+// overwrite there is past the end of the output
+#define WORD 16
+
+static uint32_t read32( const unsigned char *p )
+{
+	uint32_t v;
+	memcpy(&v,p,4);
+	return v;
+}
+
+static int hash( uint32_t v )
+{
+	return (v*2654435761u) >> (32-HASH_BITS);
+}
+
+// store the part of a length past MORE as a run of bytes, the last one below 255
+static int putlength( unsigned char *out, int o, int n )
+{
+	while(n>=255) {
+		out[o++] = 255;
+		n -= 255;
+	}
+	out[o++] = n;
+	return o;
+}
+
+// add the part of a length past MORE, read from in[*i...]; returns -1 if the stream ends first
+static int getlength( const unsigned char *in, int *i, int inmax, int n )
+{
+	int b;
+	do {
+		if(*i>=inmax || n>(1<<30)) return -1;
+		b = in[(*i)++];
+		n += b;
+	} while(b==255);
+	return n;
+}
+
+// append a sequence of "nlit" literals and a match of "len" bytes "offset" back,
+// or the literals and the end of the stream if offset is 0; returns -1 if out is too small
+static int emit( unsigned char *out, int o, int outmax, const unsigned char *lit, int nlit, int offset, int len )
+{
+	int mlen = offset ? len-MIN_MATCH : 0;
+	if(o + 1 + nlit/255+1 + nlit + 2 + mlen/255+1 > outmax) return -1;
+
+	out[o++] = (nlit<MORE ? nlit : MORE) << 4 | (mlen<MORE ? mlen : MORE);
+	if(nlit>=MORE) o = putlength(out,o,nlit-MORE);
+	memcpy(out+o,lit,nlit);
+	o += nlit;
+	out[o++] = offset & 0xff;
+	out[o++] = offset >> 8;
+	if(mlen>=MORE) o = putlength(out,o,mlen-MORE);
+	return o;
+}
+
+int lz_compress( const unsigned char *in, int n, unsigned char *out, int outmax )
+{
+	int table[1<<HASH_BITS];
+	int anchor = 0;
+	int pos = 0;
+	int o = 0;
+
+	for(int i=0; i<(1<<HASH_BITS); i++) table[i] = -1;
+
+	while(pos+MIN_MATCH<=n) {
+		uint32_t v = read32(in+pos);
+		int h = hash(v);
+		int ref = table[h];
+		table[h] = pos;
+
+		// data that keeps failing to match is skipped over faster and faster
+		if(ref<0 || pos-ref>MAX_OFFSET || read32(in+ref)!=v) {
+			pos += 1 + ((pos-anchor) >> 6);
+			continue;
+		}
+
+		int len = MIN_MATCH;
+		while(pos+len<n && in[ref+len]==in[pos+len]) len++;
+
+		o = emit(out,o,outmax,in+anchor,pos-anchor,pos-ref,len);
+		if(o<0) return 0;
+		pos += len;
+		anchor = pos;
+	}
+
+	o = emit(out,o,outmax,in+anchor,n-anchor,0,0);
+	return o<0 ? 0 : o;
+}
+
+int lz_decompress( const unsigned char *in, int inmax, unsigned char *out, int outmax )
+{
+	int i = 0;
+	int o = 0;
+
+	while(i<inmax) {
+		int token = in[i++];
+
+		int nlit = token >> 4;
+		if(nlit==MORE && (nlit = getlength(in,&i,inmax,nlit))<0) return -1;
+		if(nlit>inmax-i || nlit>outmax-o) return -1;
+		if(nlit<=WORD && inmax-i>=WORD && outmax-o>=WORD) memcpy(out+o,in+i,WORD);
+		else memcpy(out+o,in+i,nlit);
+		i += nlit;
+		o += nlit;
+
+		if(inmax-i<2) return -1;
+		int offset = in[i] | in[i+1] << 8;
+		i += 2;
+		if(offset==0) return o;
+
+		int len = token & 15;
+		if(len==MORE && (len = getlength(in,&i,inmax,len))<0) return -1;
+		len += MIN_MATCH;
+		if(offset>o || len>outmax-o) return -1;
+
+		// a match may overlap its own output; it is copied a period at a time
+		unsigned char *d = out+o;
+		const unsigned char *s = d-offset;
+		o += len;
+		if(offset>=WORD && outmax-o>=WORD) {
+			for(int k=0; k<len; k+=WORD) memcpy(d+k,s+k,WORD);
+			continue;
+		}
+		while(len>0) {
+			int k = len<offset ? len : offset;
+			memcpy(d,s,k);
+			d += k;
+			s += k;
+			len -= k;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,27 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+A small LZ77 codec in the style of LZ4, fast enough to sit in the data path.
+A stream is a series of sequences, each a token byte holding the number of literals
+and the match length, the literals, a two-byte offset back into the output, and
+any extra length bytes; an offset of zero ends the stream, so a stream can be
+decoded from a buffer with padding after it. Matches reach back at most 64 KB.
+*/
+
+/*
+Compress "n" bytes of "in" into "out", which holds at most "outmax" bytes.
+Returns the length of the stream, or 0 if it does not fit.
+*/
+
+int lz_compress( const unsigned char *in, int n, unsigned char *out, int outmax );
+
+/*
+Decompress the stream at the start of "in", which holds "inmax" bytes,
+into "out", which holds at most "outmax" bytes.
+Returns the number of bytes produced, or -1 if the stream is damaged or does not fit.
+*/
+
+int lz_decompress( const unsigned char *in, int inmax, unsigned char *out, int outmax );
+
+#endif
@@ -4,16 +4,25 @@
  */
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+// createn and deleten take at most this many inodes at once
+#define LIST_MAX (1<<20)
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int parse_list( const char *text, int **list );
+static void print_list( const int *list, int n );
 
 struct disk *thedisk = 0;
+struct fs *thefs = 0;
 
 int main( int argc, char *argv[] )
 {
@@ -21,20 +30,79 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	int inumber, result, args, opt;
+	int cacheblocks = 256, cachepolicy = CACHE_LRU;
+	int diskflags = DISK_PREAD;
+	int delalloc = 0;
+	int syncmode = FS_SYNC_NONE, syncinterval = 1000, syncdirty = 1024;
+	int stripe = 16;
+	const char *images[DISK_STRIPE_MAX];
+	int nimages = 0;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	while((opt=getopt(argc,argv,"ab:c:df:p:s:"))!=-1) {
+		if(opt=='a') {
+			delalloc = 1;
+		} else if(opt=='b' && !strcmp(optarg,"pread")) {
+			diskflags = (diskflags & DISK_DIRECT) | DISK_PREAD;
+		} else if(opt=='b' && !strcmp(optarg,"uring")) {
+			diskflags = (diskflags & DISK_DIRECT) | DISK_URING;
+		} else if(opt=='b' && !strcmp(optarg,"mmap")) {
+			diskflags = (diskflags & DISK_DIRECT) | DISK_MMAP;
+		} else if(opt=='d') {
+			diskflags |= DISK_DIRECT;
+		} else if(opt=='f' && !strcmp(optarg,"none")) {
+			syncmode = FS_SYNC_NONE;
+		} else if(opt=='f' && !strcmp(optarg,"strict")) {
+			syncmode = FS_SYNC_STRICT;
+		} else if(opt=='f' && !strncmp(optarg,"periodic",8) && (optarg[8]==0 || optarg[8]==',')) {
+			// periodic[,ms[,dirtyblocks]]
+			syncmode = FS_SYNC_PERIODIC;
+			sscanf(optarg+8,",%d,%d",&syncinterval,&syncdirty);
+		} else if(opt=='c') {
+			cacheblocks = atoi(optarg);
+		} else if(opt=='p' && !strcmp(optarg,"lru")) {
+			cachepolicy = CACHE_LRU;
+		} else if(opt=='p' && !strcmp(optarg,"clock")) {
+			cachepolicy = CACHE_CLOCK;
+		} else if(opt=='s') {
+			stripe = atoi(optarg);
+		} else {
+			argc = 0;
+			break;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-a] [-b pread|uring|mmap] [-d] [-f none|strict|periodic[,ms[,dirtyblocks]]] [-c cacheblocks] [-p lru|clock] [-s stripeblocks] <diskfile>[,<diskfile>...] <nblocks>\n",argv[0]);
 		return 1;
 	}
 
-	thedisk = disk_open(argv[1],atoi(argv[2]));
+	// several images separated by commas are striped into one disk
+	char *names = strdup(argv[optind]);
+	for(char *name=strtok(names,","); name && nimages<DISK_STRIPE_MAX; name=strtok(0,",")) {
+		images[nimages++] = name;
+	}
+
+	if(nimages>1) {
+		thedisk = disk_open_striped(images,nimages,atoi(argv[optind+1]),stripe,diskflags);
+	} else {
+		thedisk = disk_open_flags(argv[optind],atoi(argv[optind+1]),diskflags);
+	}
+	free(names);
 	if(!thedisk) {
-		printf("couldn't open %s: %s\n",argv[1],strerror(errno));
+		printf("couldn't open %s: %s\n",argv[optind],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_nblocks(thedisk));
+	thefs = fs_init(thedisk);
+	if(!thefs || !fs_setcache(thefs,cacheblocks,cachepolicy) || !fs_setdelalloc(thefs,delalloc) ||
+	   !fs_setsync(thefs,syncmode,syncinterval,syncdirty)) {
+		fs_destroy(thefs);
+		disk_close(thedisk);
+		return 1;
+	}
+
+	printf("opened emulated disk image %s with %d blocks\n",argv[optind],disk_nblocks(thedisk));
 
 	while(1) {
 		printf(" svsfs> ");
@@ -49,18 +117,24 @@ int main( int argc, char *argv[] )
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
+			// format [extents|compressed] [inodesize]
+			int extents = args>=2 && !strcmp(arg1,"extents");
+			int compressed = args>=2 && !strcmp(arg1,"compressed");
+			int layout = extents ? FS_LAYOUT_EXTENTS : compressed ? FS_LAYOUT_COMPRESSED : FS_LAYOUT_BLOCKMAP;
+			int named = extents || compressed;
+			const char *size = args==3 && named ? arg2 : args==2 && !named ? arg1 : 0;
+			if(args==1 || (args==2 && named) || (size && atoi(size)>0)) {
+				if(fs_format_inodes(thefs,layout,size ? atoi(size) : FS_INODE_SIZE)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [extents|compressed] [inodesize]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
-				if(fs_mount()) {
+				if(fs_mount(thefs)) {
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
@@ -68,16 +142,52 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount(thefs)) {
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
-				fs_debug();
+				fs_debug(thefs);
 			} else {
 				printf("use: debug\n");
 			}
+		} else if(!strcmp(cmd,"flush")) {
+			if(args==1) {
+				if(fs_flush(thefs)) {
+					printf("disk flushed.\n");
+				} else {
+					printf("flush failed!\n");
+				}
+			} else {
+				printf("use: flush\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync(thefs)) {
+					printf("disk synced.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else {
+				printf("use: sync\n");
+			}
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				fs_stats(thefs);
+			} else {
+				printf("use: stats\n");
+			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
+				result = fs_getsize(thefs,inumber);
 				if(result>=0) {
 					printf("inode %d has size %d\n",inumber,result);
 				} else {
@@ -87,9 +197,20 @@ int main( int argc, char *argv[] )
 				printf("use: getsize <inumber>\n");
 			}
 			
+		} else if(!strcmp(cmd,"compress")) {
+			if(args==3 && (!strcmp(arg2,"on") || !strcmp(arg2,"off"))) {
+				inumber = atoi(arg1);
+				if(fs_setcompress(thefs,inumber,!strcmp(arg2,"on"))) {
+					printf("inode %d compression %s.\n",inumber,arg2);
+				} else {
+					printf("compress failed!\n");
+				}
+			} else {
+				printf("use: compress <inumber> on|off\n");
+			}
 		} else if(!strcmp(cmd,"create")) {
 			if(args==1) {
-				inumber = fs_create();
+				inumber = fs_create(thefs);
 				if(inumber>0) {
 					printf("created inode %d\n",inumber);
 				} else {
@@ -101,7 +222,7 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"delete")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
+				if(fs_delete(thefs,inumber)) {
 					printf("inode %d deleted.\n",inumber);
 				} else {
 					printf("delete failed!\n");	
@@ -109,6 +230,39 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: delete <inumber>\n");
 			}
+		} else if(!strcmp(cmd,"createn")) {
+			if(args==2 && atoi(arg1)>0 && atoi(arg1)<=LIST_MAX) {
+				int n = atoi(arg1);
+				int *list = malloc(n*sizeof(int));
+				if(!list) {
+					printf("createn failed!\n");
+					continue;
+				}
+				result = fs_create_many(thefs,n,list);
+				if(result>0) {
+					printf("created %d inodes: ",result);
+					print_list(list,result);
+				} else {
+					printf("createn failed!\n");
+				}
+				free(list);
+			} else {
+				printf("use: createn <count>, with at most %d\n",LIST_MAX);
+			}
+		} else if(!strcmp(cmd,"deleten")) {
+			int *list;
+			if(args==2 && (result=parse_list(arg1,&list))>0) {
+				int n = result;
+				result = fs_delete_many(thefs,list,n);
+				if(result>0) {
+					printf("%d of %d inodes deleted.\n",result,n);
+				} else {
+					printf("deleten failed!\n");
+				}
+				free(list);
+			} else {
+				printf("use: deleten <inode>[-<inode>][,...], with at most %d inodes\n",LIST_MAX);
+			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
@@ -145,11 +299,18 @@ int main( int argc, char *argv[] )
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [extents|compressed] [inodesize]\n");
 			printf("    mount\n");
+			printf("    unmount\n");
 			printf("    debug\n");
+			printf("    flush\n");
+			printf("    sync\n");
+			printf("    stats\n");
 			printf("    create\n");
+			printf("    compress <inode> on|off\n");
 			printf("    delete  <inode>\n");
+			printf("    createn <count>\n");
+			printf("    deleten <inode>[-<inode>][,...]\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
@@ -167,6 +328,8 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	fs_destroy(thefs);
+
 	printf("closing emulated disk.\n");
 	disk_close(thedisk);
 
@@ -176,12 +339,16 @@ int main( int argc, char *argv[] )
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	int offset=0, result, actual, fd;
 	unsigned char buffer[16384];
 
+	fd = fs_open(thefs,inumber);
+	if(fd<0) return 0;
+
 	file = fopen(filename,"r");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(thefs,fd);
 		return 0;
 	}
 
@@ -189,7 +356,7 @@ static int do_copyin( const char *filename, int inumber )
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_fwrite(thefs,fd,buffer,result);
 			if(actual<0) {
 				printf("ERROR: fs_write return invalid result %d\n",actual);
 				break;
@@ -205,23 +372,28 @@ static int do_copyin( const char *filename, int inumber )
 	printf("%d bytes copied\n",offset);
 
 	fclose(file);
+	fs_close(thefs,fd);
 	return 1;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
+	int offset=0, result, fd;
 	unsigned char buffer[16384];
 
+	fd = fs_open(thefs,inumber);
+	if(fd<0) return 0;
+
 	file = fopen(filename,"w");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(thefs,fd);
 		return 0;
 	}
 
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs_fread(thefs,fd,buffer,sizeof(buffer));
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
@@ -230,6 +402,66 @@ static int do_copyout( int inumber, const char *filename )
 	printf("%d bytes copied\n",offset);
 
 	fclose(file);
+	fs_close(thefs,fd);
 	return 1;
 }
 
+
+// parse a list such as "3,7-9,12" into a new array; returns its length,
+// or 0 if it is malformed or holds more than LIST_MAX inodes
+static int parse_list( const char *text, int **list )
+{
+	int n = 0, size = 64;
+	int *l = malloc(size*sizeof(int));
+	const char *p = text;
+
+	while(l) {
+		char *end;
+		long first = strtol(p,&end,10);
+		long last = first;
+		if(end==p) break;
+		p = end;
+		if(*p=='-') {
+			last = strtol(p+1,&end,10);
+			if(end==p+1 || last<first) break;
+			p = end;
+		}
+		if(first<INT_MIN || last>INT_MAX || last-first>=LIST_MAX-n) break;
+
+		for(long i=first; i<=last && l; i++) {
+			if(n==size) {
+				size *= 2;
+				int *bigger = realloc(l,size*sizeof(int));
+				if(!bigger) {
+					free(l);
+					l = 0;
+					break;
+				}
+				l = bigger;
+			}
+			l[n++] = i;
+		}
+
+		if(*p==0 && l) {
+			*list = l;
+			return n;
+		}
+		if(*p!=',') break;
+		p++;
+	}
+
+	free(l);
+	return 0;
+}
+
+// print a list of inode numbers, folding consecutive ones into ranges
+static void print_list( const int *list, int n )
+{
+	for(int i=0; i<n; ) {
+		int j = i;
+		while(j+1<n && list[j+1]==list[j]+1) j++;
+		if(j>i) printf("%d-%d",list[i],list[j]); else printf("%d",list[i]);
+		printf(j+1<n ? "," : "\n");
+		i = j+1;
+	}
+}
@@ -0,0 +1,191 @@
+/*
+io_uring without liburing.
+The submission and completion rings are shared with the kernel through mmap;
+the head and tail indexes are read and written with acquire and release ordering.
+*/
+
+#define _DEFAULT_SOURCE
+
+#include "uring.h"
+
+#include <linux/io_uring.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct uring {
+	int ringfd;
+	int fd;
+	unsigned depth;
+	unsigned queued;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_size;
+	void *cq_ring;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+static int sys_setup( unsigned entries, struct io_uring_params *p )
+{
+	return syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int sys_enter( int fd, unsigned submit, unsigned wait, unsigned flags )
+{
+	return syscall(__NR_io_uring_enter,fd,submit,wait,flags,NULL,0);
+}
+
+struct uring * uring_create( int fd, int depth )
+{
+	struct io_uring_params p;
+	struct uring *u;
+
+	u = calloc(1,sizeof(*u));
+	if(!u) return 0;
+
+	memset(&p,0,sizeof(p));
+	u->ringfd = sys_setup(depth,&p);
+	if(u->ringfd<0) {
+		free(u);
+		return 0;
+	}
+
+	u->fd = fd;
+	u->depth = p.sq_entries;
+
+	u->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(u->cq_size>u->sq_size) u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+
+	u->sq_ring = mmap(0,u->sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->ringfd,IORING_OFF_SQ_RING);
+	if(u->sq_ring==MAP_FAILED) {
+		close(u->ringfd);
+		free(u);
+		return 0;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(0,u->cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->ringfd,IORING_OFF_CQ_RING);
+		if(u->cq_ring==MAP_FAILED) {
+			munmap(u->sq_ring,u->sq_size);
+			close(u->ringfd);
+			free(u);
+			return 0;
+		}
+	}
+
+	u->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	u->sqes = mmap(0,u->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->ringfd,IORING_OFF_SQES);
+	if(u->sqes==MAP_FAILED) {
+		if(u->cq_ring!=u->sq_ring) munmap(u->cq_ring,u->cq_size);
+		munmap(u->sq_ring,u->sq_size);
+		close(u->ringfd);
+		free(u);
+		return 0;
+	}
+
+	char *sq = u->sq_ring;
+	u->sq_head = (unsigned*)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+
+	char *cq = u->cq_ring;
+	u->cq_head = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return u;
+}
+
+int uring_depth( struct uring *u )
+{
+	return u->depth;
+}
+
+int uring_queue( struct uring *u, int write, const struct iovec *iov, int n, off_t offset, uint64_t tag )
+{
+	unsigned head = __atomic_load_n(u->sq_head,__ATOMIC_ACQUIRE);
+	unsigned tail = *u->sq_tail;
+
+	if(tail-head>=u->depth) return 0;
+
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = u->fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = n;
+	sqe->off = offset;
+	sqe->user_data = tag;
+
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail,tail+1,__ATOMIC_RELEASE);
+	u->queued++;
+
+	return 1;
+}
+
+int uring_submit( struct uring *u, int wait )
+{
+	unsigned flags = wait>0 ? IORING_ENTER_GETEVENTS : 0;
+
+	while(1) {
+		int result = sys_enter(u->ringfd,u->queued,wait,flags);
+		if(result>=0) {
+			u->queued -= result;
+			return 1;
+		}
+		if(errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) return 0;
+	}
+}
+
+int uring_reap( struct uring *u, uint64_t *tag, int *result )
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail,__ATOMIC_ACQUIRE);
+
+	if(head==tail) return 0;
+
+	struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+	*tag = cqe->user_data;
+	*result = cqe->res;
+
+	__atomic_store_n(u->cq_head,head+1,__ATOMIC_RELEASE);
+
+	return 1;
+}
+
+void uring_destroy( struct uring *u )
+{
+	if(!u) return;
+	munmap(u->sqes,u->sqes_size);
+	if(u->cq_ring!=u->sq_ring) munmap(u->cq_ring,u->cq_size);
+	munmap(u->sq_ring,u->sq_size);
+	close(u->ringfd);
+	free(u);
+}
@@ -0,0 +1,55 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+A minimal io_uring instance driven through the raw system calls.
+Requests are queued in the submission ring, handed to the kernel in batches,
+and their results collected from the completion ring.
+*/
+
+/*
+Create a ring with room for "depth" requests in flight on file descriptor "fd".
+Returns a pointer to a new ring, or null if io_uring is not available.
+*/
+
+struct uring * uring_create( int fd, int depth );
+
+/*
+Return the number of requests the ring can hold.
+*/
+
+int uring_depth( struct uring *u );
+
+/*
+Queue a vectored read or write of "n" buffers at byte "offset" of the file.
+"tag" is handed back with the completion.
+Returns 1 if the request was queued, or 0 if the submission ring is full.
+*/
+
+int uring_queue( struct uring *u, int write, const struct iovec *iov, int n, off_t offset, uint64_t tag );
+
+/*
+Hand every queued request to the kernel and wait until at least "wait" completions are ready.
+Returns 1 on success and 0 on failure.
+*/
+
+int uring_submit( struct uring *u, int wait );
+
+/*
+Take one completion off the ring, storing its tag and result.
+Returns 1 if there was one, or 0 if the completion ring is empty.
+*/
+
+int uring_reap( struct uring *u, uint64_t *tag, int *result );
+
+/*
+Release the ring.
+*/
+
+void uring_destroy( struct uring *u );
+
+#endif